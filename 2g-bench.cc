@@ -0,0 +1,409 @@
+// Benchmarks of tokenizing, indexing and searching, written as JSON so
+// that releases can be compared.
+//
+//   2g-bench [-o results.json] [-n documents] [-s seed] [-d scratch directory]
+//            [-S max documents] [-t seconds]
+//
+// The corpus is generated from the seed, so runs with the same arguments
+// index the same text. A Redis server given as BENCH_REDIS=host:port is
+// benchmarked as well.
+//
+// With -S the drivers instead index a corpus growing tenfold from 1000
+// documents up to the maximum, searching it after each step. A driver
+// drops out once a step takes longer than -t seconds to add.
+#include <string>
+#include <vector>
+#include <set>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <sqlite3.h>
+
+#include "Bigram.hh"
+#include "Corpus.hh"
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    double seconds_since(Clock::time_point start)
+    {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // One line of the JSON output: a benchmark, the case it ran and its
+    // measurements.
+    struct Result {
+	std::string name;
+	std::string variant;
+	std::vector<std::pair<std::string, double>> values;
+    };
+
+    std::vector<Result> results;
+
+    void report(const std::string &name, const std::string &variant,
+		const std::vector<std::pair<std::string, double>> &values)
+    {
+	Result result = {name, variant, values};
+	results.push_back(result);
+
+	std::cerr << std::left << std::setw(24) << name << std::setw(12) << variant;
+	for (auto &value : values)
+	    std::cerr << " " << value.first << "=" << value.second;
+	std::cerr << std::endl;
+    }
+
+    void write_json(std::ostream &os, unsigned seed, size_t documents)
+    {
+	os << "{\n  \"seed\": " << seed << ",\n  \"documents\": " << documents
+	   << ",\n  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i ++) {
+	    auto &result = results[i];
+	    os << "    {\"name\": \"" << result.name << "\", \"variant\": \""
+	       << result.variant << "\"";
+	    for (auto &value : result.values)
+		os << ", \"" << value.first << "\": " << std::setprecision(6) << value.second;
+	    os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	os << "  ]\n}\n";
+    }
+
+    size_t count_records(const std::string &text)
+    {
+	size_t records = 0;
+	std::istringstream is(text);
+	std::string line;
+	while (std::getline(is, line)) {
+	    for (Bigram::BigramCursor bg(line); bg.valid(); bg.next())
+		records ++;
+	}
+	return records;
+    }
+
+    size_t file_size(const std::string &path)
+    {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+    void bench_disassemble(const std::string &variant, const std::string &text)
+    {
+	size_t bytes = 0;
+	size_t chars = 0;
+	auto start = Clock::now();
+	do {
+	    chars += Bigram::disassemble(text).size();
+	    bytes += text.length();
+	} while (seconds_since(start) < 0.5);
+	double seconds = seconds_since(start);
+	report("disassemble", variant,
+	       {{"mb_per_sec", bytes / seconds / 1e6}, {"chars_per_sec", chars / seconds}});
+    }
+
+    // About size bytes of generated text in one script only.
+    std::string script_text(Corpus::Options options, double cjk, size_t size)
+    {
+	options.cjk = cjk;
+	options.emoji = 0;
+	Corpus::Generator generator(options);
+	std::string dest;
+	for (uint64_t n = 0; dest.length() < size; n ++)
+	    dest += generator.document(n);
+	return dest;
+    }
+
+    struct Document {
+	std::string id;
+	std::string text;
+    };
+
+    // Documents first to last - 1, and the number of records they add.
+    std::vector<Document> generate(const Corpus::Generator &generator, uint64_t first,
+				   uint64_t last, size_t &records)
+    {
+	std::vector<Document> corpus;
+	records = 0;
+	for (uint64_t n = first; n < last; n ++) {
+	    std::ostringstream id;
+	    id << "bench-" << generator.options().seed << "-" << n;
+	    Document doc = {id.str(), generator.document(n)};
+	    records += count_records(doc.text);
+	    corpus.push_back(doc);
+	}
+	return corpus;
+    }
+
+    double bench_add(const std::string &variant, Bigram::Dictionary &dict,
+		     const std::vector<Document> &corpus, size_t records, uint64_t documents,
+		     const std::function<void()> &finish = std::function<void()>())
+    {
+	auto start = Clock::now();
+	for (auto &doc : corpus) {
+	    std::istringstream is(doc.text);
+	    dict.add(doc.id, is);
+	}
+	if (finish)
+	    finish();
+	double seconds = seconds_since(start);
+	report("add", variant,
+	       {{"documents", double(documents)}, {"records_per_sec", records / seconds},
+		{"seconds", seconds}});
+	return seconds;
+    }
+
+    double percentile(const std::vector<double> &sorted, double p)
+    {
+	return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+    }
+
+    void bench_search(const std::string &variant, const Bigram::Dictionary &dict,
+		      const std::vector<std::string> &phrases, const std::string &length,
+		      uint64_t documents)
+    {
+	std::vector<double> micros;
+	size_t matches = 0;
+	for (auto &phrase : phrases) {
+	    auto start = Clock::now();
+	    matches += dict.search(phrase).size();
+	    micros.push_back(seconds_since(start) * 1e6);
+	}
+	std::sort(micros.begin(), micros.end());
+	report("search_" + length, variant,
+	       {{"documents", double(documents)},
+		{"p50_us", percentile(micros, 0.5)}, {"p90_us", percentile(micros, 0.9)},
+		{"p99_us", percentile(micros, 0.99)}, {"max_us", micros.back()},
+		{"matches", double(matches)}});
+    }
+
+    // Phrases cut out of the corpus, so that every one of them matches.
+    std::vector<std::string> sample_phrases(std::mt19937 &rng, const std::vector<Document> &corpus,
+					    size_t count, size_t length)
+    {
+	std::vector<std::string> dest;
+	std::uniform_int_distribution<size_t> pick(0, corpus.size() - 1);
+	while (dest.size() < count) {
+	    auto &text = corpus[pick(rng)].text;
+	    if (text.length() <= length)
+		continue;
+	    std::uniform_int_distribution<size_t> at(0, text.length() - length);
+	    // cut on character boundaries, so that CJK phrases stay valid UTF-8
+	    size_t begin = at(rng);
+	    size_t end = begin + length;
+	    while (begin > 0 && (text[begin] & 0xc0) == 0x80)
+		begin --;
+	    while (end < text.length() && (text[end] & 0xc0) == 0x80)
+		end ++;
+	    std::string phrase = text.substr(begin, end - begin);
+	    if (phrase.find('\n') == phrase.npos && phrase[0] != ' ')
+		dest.push_back(phrase);
+	}
+	return dest;
+    }
+
+    std::shared_ptr<Bigram::Driver> redis_driver()
+    {
+	const char *address = getenv("BENCH_REDIS");
+	if (!address)
+	    return std::shared_ptr<Bigram::Driver>();
+	std::string host;
+	unsigned short port;
+	Bigram::RedisDriver::split_address(address, host, port);
+	return std::shared_ptr<Bigram::Driver>(new Bigram::RedisDriver(host, port));
+    }
+
+    void bench_drivers(const Corpus::Generator &generator, uint64_t documents, const std::string &dir)
+    {
+	std::mt19937 rng(generator.options().seed);
+	size_t records;
+	auto corpus = generate(generator, 0, documents, records);
+	auto short_phrases = sample_phrases(rng, corpus, 1000, 3);
+	auto long_phrases = sample_phrases(rng, corpus, 1000, 24);
+
+	std::shared_ptr<Bigram::MemoryDriver> mem(new Bigram::MemoryDriver);
+	Bigram::Dictionary memory(mem);
+	bench_add("memory", memory, corpus, records, documents);
+	bench_search("memory", memory, short_phrases, "short", documents);
+	bench_search("memory", memory, long_phrases, "long", documents);
+	report("footprint", "memory",
+	       {{"documents", double(documents)}, {"bytes", double(mem->memory_usage())}});
+
+	std::shared_ptr<Bigram::SnapshotDriver> snap(new Bigram::SnapshotDriver);
+	Bigram::Dictionary snapshot(snap);
+	bench_add("snapshot", snapshot, corpus, records, documents, [&snap]() { snap->publish(); });
+	bench_search("snapshot", snapshot, short_phrases, "short", documents);
+	bench_search("snapshot", snapshot, long_phrases, "long", documents);
+
+	std::string idx = dir + "/2g-bench.idx";
+	auto start = Clock::now();
+	Bigram::MmapDriver::write(idx, *mem);
+	Bigram::Dictionary mapped(std::shared_ptr<Bigram::Driver>(new Bigram::MmapDriver(idx)));
+	report("write_open", "mmap", {{"documents", double(documents)}, {"seconds", seconds_since(start)}});
+	bench_search("mmap", mapped, short_phrases, "short", documents);
+	bench_search("mmap", mapped, long_phrases, "long", documents);
+	report("footprint", "mmap", {{"documents", double(documents)}, {"bytes", double(file_size(idx))}});
+
+	std::string db = dir + "/2g-bench.sqlite";
+	remove(db.c_str());
+	{
+	    Bigram::Dictionary sqlite(std::shared_ptr<Bigram::Driver>(new Bigram::SQLiteDriver(db)));
+	    bench_add("sqlite", sqlite, corpus, records, documents);
+	    bench_search("sqlite", sqlite, short_phrases, "short", documents);
+	    bench_search("sqlite", sqlite, long_phrases, "long", documents);
+	}
+	report("footprint", "sqlite", {{"documents", double(documents)}, {"bytes", double(file_size(db))}});
+
+	if (auto driver = redis_driver()) {
+	    Bigram::Dictionary redis(driver);
+	    bench_add("redis", redis, corpus, records, documents);
+	    bench_search("redis", redis, short_phrases, "short", documents);
+	    bench_search("redis", redis, long_phrases, "long", documents);
+	}
+    }
+
+    // A driver in the scaling run, until a step takes it too long.
+    struct Target {
+	std::string name;
+	std::shared_ptr<Bigram::Dictionary> dict;
+	std::function<void()> finish;
+	bool active;
+    };
+
+    void bench_scale(const Corpus::Generator &generator, uint64_t max, double budget,
+		     const std::string &dir)
+    {
+	std::mt19937 rng(generator.options().seed);
+	std::string db = dir + "/2g-scale.sqlite";
+	std::string idx = dir + "/2g-scale.idx";
+	remove(db.c_str());
+
+	std::shared_ptr<Bigram::MemoryDriver> mem(new Bigram::MemoryDriver);
+	std::shared_ptr<Bigram::SnapshotDriver> snap(new Bigram::SnapshotDriver);
+	std::vector<Target> targets;
+	Target memory = {"memory", std::make_shared<Bigram::Dictionary>(mem), nullptr, true};
+	Target snapshot = {"snapshot", std::make_shared<Bigram::Dictionary>(snap),
+			   [&snap]() { snap->publish(); }, true};
+	Target sqlite = {"sqlite", std::make_shared<Bigram::Dictionary>(
+		std::shared_ptr<Bigram::Driver>(new Bigram::SQLiteDriver(db))), nullptr, true};
+	targets.push_back(memory);
+	targets.push_back(snapshot);
+	targets.push_back(sqlite);
+	if (auto driver = redis_driver()) {
+	    Target redis = {"redis", std::make_shared<Bigram::Dictionary>(driver), nullptr, true};
+	    targets.push_back(redis);
+	}
+
+	uint64_t indexed = 0;
+	for (uint64_t documents = 1000; documents <= max; documents *= 10) {
+	    // each step adds the documents the previous ones did not
+	    size_t records;
+	    auto corpus = generate(generator, indexed, documents, records);
+	    auto short_phrases = sample_phrases(rng, corpus, 1000, 3);
+	    auto long_phrases = sample_phrases(rng, corpus, 1000, 24);
+	    indexed = documents;
+
+	    for (auto &target : targets) {
+		if (!target.active)
+		    continue;
+		double seconds = bench_add(target.name, *target.dict, corpus, records, documents,
+					   target.finish);
+		bench_search(target.name, *target.dict, short_phrases, "short", documents);
+		bench_search(target.name, *target.dict, long_phrases, "long", documents);
+		if (seconds > budget) {
+		    std::cerr << target.name << " took " << seconds << "s at " << documents
+			      << " documents, stopping it" << std::endl;
+		    target.active = false;
+		}
+	    }
+
+	    if (targets[0].active) {
+		report("footprint", "memory",
+		       {{"documents", double(documents)}, {"bytes", double(mem->memory_usage())}});
+		auto start = Clock::now();
+		Bigram::MmapDriver::write(idx, *mem);
+		Bigram::Dictionary mapped(std::shared_ptr<Bigram::Driver>(new Bigram::MmapDriver(idx)));
+		report("write_open", "mmap",
+		       {{"documents", double(documents)}, {"seconds", seconds_since(start)}});
+		bench_search("mmap", mapped, short_phrases, "short", documents);
+		bench_search("mmap", mapped, long_phrases, "long", documents);
+	    }
+	    if (targets[2].active)
+		report("footprint", "sqlite",
+		       {{"documents", double(documents)}, {"bytes", double(file_size(db))}});
+	}
+    }
+
+    void usage()
+    {
+	std::cerr << "usage: 2g-bench [-o results.json] [-n documents] [-s seed] [-d directory]\n"
+		  << "                [-S max documents] [-t seconds]" << std::endl;
+	exit(2);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string output;
+    uint64_t documents = 2000;
+    uint64_t scale = 0;
+    double budget = 60;
+    Corpus::Options options;
+    std::string dir = "/tmp";
+
+    int c;
+    while ((c = getopt(argc, argv, "o:n:s:d:S:t:")) != -1) {
+	switch (c) {
+	case 'o': output = optarg; break;
+	case 'n': documents = strtoull(optarg, nullptr, 10); break;
+	case 's': options.seed = strtoul(optarg, nullptr, 10); break;
+	case 'd': dir = optarg; break;
+	case 'S': scale = strtoull(optarg, nullptr, 10); break;
+	case 't': budget = atof(optarg); break;
+	default: usage();
+	}
+    }
+    if (documents == 0 || (scale != 0 && scale < 1000))
+	usage();
+
+    try {
+	bench_disassemble("ascii", script_text(options, 0, 1 << 20));
+	bench_disassemble("cjk", script_text(options, 1, 1 << 20));
+
+	if (scale) {
+	    // shorter documents, so that a million of them fit in memory
+	    options.min_lines = 2;
+	    options.max_lines = 10;
+	    bench_scale(Corpus::Generator(options), scale, budget, dir);
+	    documents = scale;
+	} else {
+	    bench_drivers(Corpus::Generator(options), documents, dir);
+	}
+    } catch (const std::string &e) {
+	std::cerr << "2g-bench: " << e << std::endl;
+	return 1;
+    }
+
+    if (output.empty()) {
+	write_json(std::cout, options.seed, documents);
+    } else {
+	std::ofstream os(output);
+	write_json(os, options.seed, documents);
+    }
+    return 0;
+}
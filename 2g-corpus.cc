@@ -0,0 +1,95 @@
+// Writes a synthetic corpus for indexing at scale.
+//
+//   2g-corpus [-n documents] [-s seed] [-d directory] [-v vocabulary] [-z zipf]
+//             [-l min:max line bytes] [-L min:max lines] [-c cjk] [-e emoji]
+//             [-u duplicates] [-f first document]
+//
+// Document n is written to directory/Corpus::Generator::path(n) and its
+// path printed, so the output can be piped into 2g-index. The same
+// options always give the same files.
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "Corpus.hh"
+
+static void usage()
+{
+    std::cerr << "usage: 2g-corpus [-n documents] [-s seed] [-d directory] [-v vocabulary] [-z zipf]\n"
+	      << "                 [-l min:max line bytes] [-L min:max lines] [-c cjk] [-e emoji]\n"
+	      << "                 [-u duplicates] [-f first document]" << std::endl;
+    exit(2);
+}
+
+static void parse_range(const char *arg, size_t &min, size_t &max)
+{
+    char *end;
+    min = max = strtoul(arg, &end, 10);
+    if (*end == ':')
+	max = strtoul(end + 1, &end, 10);
+    if (*end || min > max)
+	usage();
+}
+
+// mkdir -p for the directories of path
+static void make_parents(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != path.npos; slash = path.find('/', slash + 1)) {
+	if (mkdir(path.substr(0, slash).c_str(), 0777) != 0 && errno != EEXIST)
+	    throw "cannot create " + path.substr(0, slash);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Corpus::Options options;
+    uint64_t documents = 1000;
+    uint64_t first = 0;
+    std::string dir = "corpus";
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:d:v:z:l:L:c:e:u:f:")) != -1) {
+	switch (c) {
+	case 'n': documents = strtoull(optarg, nullptr, 10); break;
+	case 's': options.seed = strtoul(optarg, nullptr, 10); break;
+	case 'd': dir = optarg; break;
+	case 'v': options.vocabulary = strtoul(optarg, nullptr, 10); break;
+	case 'z': options.zipf = atof(optarg); break;
+	case 'l': parse_range(optarg, options.min_line, options.max_line); break;
+	case 'L': parse_range(optarg, options.min_lines, options.max_lines); break;
+	case 'c': options.cjk = atof(optarg); break;
+	case 'e': options.emoji = atof(optarg); break;
+	case 'u': options.duplicates = atof(optarg); break;
+	case 'f': first = strtoull(optarg, nullptr, 10); break;
+	default: usage();
+	}
+    }
+    if (optind != argc)
+	usage();
+
+    try {
+	Corpus::Generator generator(options);
+	for (uint64_t n = first; n < first + documents; n ++) {
+	    std::string path = dir + "/" + Corpus::Generator::path(n);
+	    if (n == first || n % 1000 == 0)
+		make_parents(path);
+	    std::ofstream os(path.c_str(), std::ios::binary);
+	    os << generator.document(n);
+	    if (!os)
+		throw "cannot write " + path;
+	    std::cout << path << "\n";
+	}
+    } catch (const std::string &e) {
+	std::cerr << "2g-corpus: " << e << std::endl;
+	return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Indexes files into a bigram index.
+//
+//   2g-index [-b sqlite|mmap|redis] [-o index] [-j threads] [-u] [path...]
+//
+// Paths are read one per line from standard input when none are given.
+// The sqlite backend (default) and the redis one add to an existing index;
+// with -u they bring it up to date instead, re-indexing changed files and
+// dropping the given paths that no longer exist. The mmap backend builds the index in memory and
+// writes a snapshot that 2g-search maps read-only. Files that cannot be
+// read or are not valid UTF-8 are reported and left out, and the exit
+// status is 1.
+#include <string>
+#include <vector>
+#include <set>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "Bigram.hh"
+
+static void usage()
+{
+    std::cerr << "usage: 2g-index [-b sqlite|mmap|redis] [-o index] [-j threads] [-u] [path...]"
+	      << std::endl;
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string backend = "sqlite";
+    std::string output;
+    unsigned threads = 0;
+    bool update = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:o:j:u")) != -1) {
+	switch (c) {
+	case 'b': backend = optarg; break;
+	case 'o': output = optarg; break;
+	case 'j': threads = atoi(optarg); break;
+	case 'u': update = true; break;
+	default: usage();
+	}
+    }
+
+    std::vector<Bigram::Path> paths;
+    for (int i = optind; i < argc; i ++)
+	paths.push_back(Bigram::Path(argv[i]));
+    if (optind == argc) {
+	std::string line;
+	while (std::getline(std::cin, line)) {
+	    if (!line.empty())
+		paths.push_back(Bigram::Path(line));
+	}
+    }
+
+    std::vector<std::pair<Bigram::Path, std::string>> skipped;
+    try {
+	if (backend == "mmap") {
+	    if (update)
+		usage();
+	    std::shared_ptr<Bigram::MemoryDriver> mem(new Bigram::MemoryDriver);
+	    Bigram::Dictionary dict(mem);
+	    dict.add(paths, threads, &skipped);
+	    Bigram::MmapDriver::write(output.empty() ? "2g.idx" : output, *mem);
+	} else {
+	    std::shared_ptr<Bigram::Driver> drv;
+	    if (backend == "sqlite") {
+		drv.reset(new Bigram::SQLiteDriver(output.empty() ? "2g.sqlite" : output));
+	    } else if (backend == "redis") {
+		std::string host;
+		unsigned short port;
+		Bigram::RedisDriver::split_address(output.empty() ? "localhost" : output,
+						   host, port);
+		drv.reset(new Bigram::RedisDriver(host, port));
+	    } else {
+		usage();
+	    }
+
+	    Bigram::Dictionary dict(drv);
+	    if (update)
+		dict.sync(paths, &skipped);
+	    else
+		dict.add(paths, threads, &skipped);
+	}
+    } catch (const std::string &e) {
+	std::cerr << "2g-index: " << e << std::endl;
+	return 1;
+    } catch (const std::exception &e) {
+	std::cerr << "2g-index: " << e.what() << std::endl;
+	return 1;
+    }
+
+    for (auto &skip : skipped) {
+	const std::string &name = skip.first;
+	std::cerr << "2g-index: " << name << ": " << skip.second << std::endl;
+    }
+    return skipped.empty() ? 0 : 1;
+}
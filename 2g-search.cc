@@ -0,0 +1,144 @@
+// Prints the lines of indexed files that contain a phrase.
+//
+//   2g-search [-b sqlite|mmap|redis] [-i index] [-k count] [-m] phrase...
+//
+// Each match is printed once per line as path:line:text, with lines
+// counted from 1. With -k, phrases need not match exactly: the count
+// files sharing the most bigrams with each phrase are printed as
+// score:path, best first. -m prints the engine's metrics to standard
+// error afterwards, in Prometheus text format.
+#include <string>
+#include <vector>
+#include <set>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "Bigram.hh"
+
+static void usage()
+{
+    std::cerr << "usage: 2g-search [-b sqlite|mmap|redis] [-i index] [-k count] [-m] phrase..."
+	      << std::endl;
+    exit(2);
+}
+
+// Offsets count the bytes of preceding lines without their newlines,
+// as the indexer does.
+// Returns whether a line was printed; the file may have gone or changed
+// since it was indexed.
+static bool print_lines(const Bigram::Path &path, const std::set<uint32_t> &offsets)
+{
+    bool printed = false;
+    const std::string &name = path;
+    std::ifstream is(name);
+    std::string line;
+    uint32_t start = 0;
+    unsigned lineno = 0;
+    auto it = offsets.cbegin();
+    while (it != offsets.cend() && std::getline(is, line)) {
+	lineno ++;
+	uint32_t end = start + line.length();
+	if (*it < end) {
+	    std::cout << name << ":" << lineno << ":" << line << "\n";
+	    printed = true;
+	    while (it != offsets.cend() && *it < end)
+		++ it;
+	}
+	start = end;
+    }
+    return printed;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string backend = "sqlite";
+    std::string index;
+    size_t ranked = 0;
+    bool metrics = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:i:k:m")) != -1) {
+	switch (c) {
+	case 'b': backend = optarg; break;
+	case 'i': index = optarg; break;
+	case 'k': ranked = atoi(optarg); break;
+	case 'm': metrics = true; break;
+	default: usage();
+	}
+    }
+    if (optind == argc)
+	usage();
+
+    try {
+	std::shared_ptr<Bigram::Driver> drv;
+	if (backend == "sqlite") {
+	    drv.reset(new Bigram::SQLiteDriver(index.empty() ? "2g.sqlite" : index));
+	} else if (backend == "mmap") {
+	    drv.reset(new Bigram::MmapDriver(index.empty() ? "2g.idx" : index));
+	} else if (backend == "redis") {
+	    std::string host;
+	    unsigned short port;
+	    Bigram::RedisDriver::split_address(index.empty() ? "localhost" : index, host, port);
+	    drv.reset(new Bigram::RedisDriver(host, port));
+	} else {
+	    usage();
+	}
+	Bigram::Dictionary dict(drv);
+
+	bool found = false;
+	for (int i = optind; i < argc && ranked > 0; i ++) {
+	    for (auto &doc : dict.search_ranked(argv[i], ranked)) {
+		for (auto &path : dict.lookup_digest(doc.docid())) {
+		    const std::string &name = path;
+		    std::cout << doc.score() << ":" << name << "\n";
+		    found = true;
+		}
+	    }
+	}
+	// all phrases are looked up together, sharing their bigrams
+	std::vector<std::string> phrases(argv + optind, argv + argc);
+	std::vector<std::list<Bigram::Position>> results;
+	if (ranked == 0)
+	    results = dict.search_many(phrases);
+	for (auto &result : results) {
+	    // every path with the matching content, each file read once
+	    std::map<Bigram::Path, std::set<uint32_t>> matches;
+	    std::map<std::string, std::set<Bigram::Path>> paths;
+	    for (auto &pos : result) {
+		std::string docid = pos.docid();
+		auto it = paths.find(docid);
+		if (it == paths.end())
+		    it = paths.insert(std::make_pair(docid, dict.lookup_digest(docid))).first;
+		for (auto &path : it->second)
+		    matches[path].insert(pos.position());
+	    }
+	    for (auto &match : matches) {
+		if (print_lines(match.first, match.second))
+		    found = true;
+	    }
+	}
+	if (metrics)
+	    std::cerr << Bigram::Metrics::instance().snapshot().prometheus();
+	return found ? 0 : 1;
+    } catch (const std::string &e) {
+	std::cerr << "2g-search: " << e << std::endl;
+	return 2;
+    } catch (const std::exception &e) {
+	std::cerr << "2g-search: " << e.what() << std::endl;
+	return 2;
+    }
+}
@@ -3,6 +3,7 @@
 #include <set>
 #include <list>
 #include <map>
+#include <unordered_map>
 #include <ostream>
 #include <istream>
 #include <sstream>
@@ -13,6 +14,25 @@
 #include <utility>
 #include <list>
 #include <iterator>
+#include <queue>
+#include <cstdint>
+#include <mutex>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <chrono>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 
 #include <sqlite3.h>
 #include <openssl/sha.h>
@@ -24,6 +44,98 @@
 
 using namespace Bigram;
 
+namespace {
+    // The contents of a file, mapped when the file can be mapped and read
+    // in large blocks otherwise.
+    class MappedFile {
+    public:
+	MappedFile(const std::string &filename);
+	~MappedFile();
+	const char* begin() const {return data_;}
+	const char* end() const {return data_ + size_;}
+	size_t size() const {return size_;}
+    private:
+	MappedFile(const MappedFile&);
+
+	const char *data_;
+	size_t size_;
+	bool mapped_;
+	std::vector<char> buffer_;
+    };
+
+    MappedFile::MappedFile(const std::string &filename)
+	: data_(nullptr), size_(0), mapped_(false)
+    {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	    throw std::string("cannot open file: ") + filename;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+	    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	    if (data != MAP_FAILED) {
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		data_ = (const char*)data;
+		size_ = st.st_size;
+		mapped_ = true;
+	    }
+	}
+	if (!mapped_) {
+	    const size_t block = 1 << 20;
+	    ssize_t n;
+	    do {
+		size_t used = buffer_.size();
+		buffer_.resize(used + block);
+		n = read(fd, buffer_.data() + used, block);
+		buffer_.resize(used + std::max(n, ssize_t(0)));
+	    } while (n > 0);
+	    if (n < 0) {
+		::close(fd);
+		throw std::string("cannot read file: ") + filename;
+	    }
+	    data_ = buffer_.data();
+	    size_ = buffer_.size();
+	}
+	::close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+	if (mapped_)
+	    munmap((void*)data_, size_);
+    }
+
+    // Calls visitor(begin, end, offset) for each line without its newline,
+    // splitting like std::getline; offset counts the bytes of the
+    // preceding lines, again without newlines.
+    template <typename Visitor>
+    void for_each_line(const char *p, const char *end, Visitor visitor)
+    {
+	size_t offset = 0;
+	while (p != end) {
+	    const char *nl = (const char*)memchr(p, '\n', end - p);
+	    const char *eol = nl ? nl : end;
+	    visitor(p, eol, offset);
+	    offset += eol - p;
+	    p = nl ? nl + 1 : end;
+	}
+    }
+
+    // The digest of a document is the SHA-1 of its lines, newlines excluded.
+    std::string digest_lines(const char *begin, const char *end)
+    {
+	SHA_CTX c;
+	SHA1_Init(&c);
+	for_each_line(begin, end, [&c](const char *b, const char *e, size_t) {
+		SHA1_Update(&c, b, e - b);
+	    });
+
+	unsigned char md[SHA_DIGEST_LENGTH];
+	SHA1_Final(md, &c);
+	return std::string((const char*)md, SHA_DIGEST_LENGTH);
+    }
+}
+
 Dictionary::Dictionary(std::shared_ptr<Driver> drv)
      : driver_(drv)
 {
@@ -39,74 +151,583 @@ std::set<Record> Dictionary::lookup(int char1, int char2) const
     return driver_->lookup(char1, char2);
 }
 
+void Dictionary::scan(int char1, int char2,
+		      const std::function<void(uint32_t, uint32_t)> &visitor) const
+{
+    driver_->scan(char1, char2, visitor);
+}
+
 void Dictionary::add(const std::string &fileid, std::istream &is)
 {
+    uint32_t document = DocumentTable::instance().intern(fileid);
     std::string line;
 
-    int offset = 0;
-    while (std::getline(is, line)) {
-	add(fileid, line, offset);
-	offset += line.length();
+    driver_->begin_batch();
+    try {
+	int offset = 0;
+	while (std::getline(is, line)) {
+	    add_line(document, line.data(), line.data() + line.length(), offset);
+	    offset += line.length();
+	}
+    } catch (...) {
+	driver_->rollback_batch();
+	throw;
     }
+    driver_->commit_batch();
 }
 
 void Dictionary::add(const std::string &fileid, const std::string &text, size_t offset)
 {
-    auto chars = disassemble(text);
-    int count = 0;
-    for (auto it = chars.cbegin();
-         it != chars.cend() && (it + 1) != chars.cend();
-         it ++, count ++) {
-        Bigram::Record rec((*it).first, (*(it + 1)).first,
-                           Bigram::Position(fileid, count + offset));
-        add(rec);
+    uint32_t document = DocumentTable::instance().intern(fileid);
+    add_line(document, text.data(), text.data() + text.length(), offset);
+}
+
+void Dictionary::add_line(uint32_t document, const char *begin, const char *end,
+			  size_t offset)
+{
+    uint64_t records = 0;
+    for (BigramCursor cur(begin, end); cur.valid(); cur.next()) {
+        Bigram::Record rec(cur.first(), cur.second(),
+                           Bigram::Position(document, cur.offset() + offset));
+        driver_->add(rec);
+	records ++;
     }
+    Metrics::instance().add(Metrics::RECORDS_INSERTED, records);
 }
 
 void Dictionary::add(const Path &filepath)
 {
-    std::string hash = Bigram::digest_file(filepath);
-    std::ifstream is(filepath);
-    add(hash, is);
+    std::string hash;
+    add_path(filepath, hash);
+}
+
+// Sets hash as soon as it is known, so that a caller can clean up after
+// a file that fails part way.
+void Dictionary::add_path(const Path &filepath, std::string &hash)
+{
+    // metadata is taken first, so a change made while reading shows up
+    // on the next sync
+    FileInfo info;
+    stat_file(filepath, info);
+
+    // The file is read once; its digest has to be known before postings
+    // can be attributed, so hashing and tokenizing are two passes over
+    // the same mapped bytes.
+    MappedFile file(filepath);
+    hash = digest_lines(file.begin(), file.end());
+    add_file(filepath, hash, file.begin(), file.end(), info);
+}
+
+void Dictionary::add_file(const Path &filepath, const std::string &hash,
+			  const char *begin, const char *end, const FileInfo &info)
+{
+    // content already indexed under another path only needs the mapping;
+    // checked inside the batch, so that a driver which holds back what it
+    // has not published still finds its own adds
+    driver_->begin_batch();
+    try {
+	if (lookup_digest(hash).empty()) {
+	    uint32_t document = DocumentTable::instance().intern(hash);
+	    for_each_line(begin, end,
+			  [this, document](const char *begin, const char *end, size_t offset) {
+			      add_line(document, begin, end, offset);
+			  });
+	}
+	register_path(filepath, hash, info);
+    } catch (...) {
+	driver_->rollback_batch();
+	throw;
+    }
+    driver_->commit_batch();
+}
+
+void Dictionary::sync(const std::vector<Path> &paths,
+		      std::vector<std::pair<Path, std::string>> *skipped)
+{
+    driver_->begin_batch();
+    try {
+	for (auto &path : paths) {
+	    std::string known;
+	    FileInfo known_info;
+	    bool indexed = driver_->lookup_path(path, known, known_info);
+
+	    FileInfo info;
+	    if (!stat_file(path, info)) {
+		if (indexed)
+		    remove_path(path, known);
+		continue;
+	    }
+	    if (indexed && info == known_info)
+		continue;
+
+	    std::string hash;
+	    try {
+		MappedFile file(path);
+		hash = digest_lines(file.begin(), file.end());
+		if (indexed && hash == known) {
+		    register_path(path, hash, info);
+		    continue;
+		}
+		if (indexed)
+		    remove_path(path, known);
+		add_file(path, hash, file.begin(), file.end(), info);
+	    } catch (const utf8::exception &e) {
+		if (!skipped)
+		    throw;
+		// add_file rolled back its own batch; a driver that cannot
+		// roll back is rid of the partial document here
+		driver_->remove_document(hash);
+		skipped->push_back(std::make_pair(path, std::string(e.what())));
+	    } catch (const std::string &e) {
+		// e.g. a directory or a file that cannot be read
+		if (!skipped)
+		    throw;
+		skipped->push_back(std::make_pair(path, e));
+	    }
+	}
+    } catch (...) {
+	driver_->rollback_batch();
+	throw;
+    }
+    driver_->commit_batch();
+}
+
+// Forgets a path, and the postings of its content once no other path
+// refers to it.
+void Dictionary::remove_path(const Path &path, const std::string &digest)
+{
+    driver_->unregister_path(path);
+    if (driver_->lookup_digest(digest).empty())
+	driver_->remove_document(digest);
+}
+
+void Dictionary::add(const std::vector<Path> &paths, unsigned threads,
+		     std::vector<std::pair<Path, std::string>> *skipped)
+{
+    if (threads == 0)
+	threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(size_t(threads), paths.size());
+
+    // Workers pull the next file from a shared counter, so a slow file
+    // never holds up the rest, and index it into a segment of their own.
+    std::atomic<size_t> next(0);
+    std::vector<std::shared_ptr<MemoryDriver>> segments;
+    for (unsigned i = 0; i < threads; i ++)
+	segments.push_back(std::shared_ptr<MemoryDriver>(new MemoryDriver));
+    // Content the driver holds already, or another file of this call, is
+    // only mapped to its new path; the first file with it is tokenized.
+    std::mutex known_mutex;
+    std::set<std::string> seen;
+    std::vector<std::string> hashes(paths.size());
+    std::vector<unsigned> owners(paths.size());
+    // A file that cannot be read or decoded is dropped from its segment
+    // and the others carry on.
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::string> reasons(skipped ? paths.size() : 0);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i ++) {
+	workers.push_back(std::thread([&, i]() {
+		    try {
+			Dictionary segment(segments[i]);
+			for (size_t n; (n = next++) < paths.size(); ) {
+			    std::string &hash = hashes[n];
+			    owners[n] = i;
+			    try {
+				FileInfo info;
+				stat_file(paths[n], info);
+				MappedFile file(paths[n]);
+				hash = digest_lines(file.begin(), file.end());
+				bool known;
+				{
+				    std::lock_guard<std::mutex> lock(known_mutex);
+				    known = !seen.insert(hash).second
+					|| !driver_->lookup_digest(hash).empty();
+				}
+				if (known)
+				    segments[i]->register_path(paths[n], hash, info);
+				else
+				    segment.add_file(paths[n], hash, file.begin(), file.end(), info);
+				continue;
+			    } catch (const utf8::exception &e) {
+				if (!skipped)
+				    throw;
+				reasons[n] = e.what();
+			    } catch (const std::string &e) {
+				if (!skipped)
+				    throw;
+				reasons[n] = e;
+			    }
+			    if (!hash.empty())
+				segments[i]->remove_document(hash);
+			}
+		    } catch (...) {
+			errors[i] = std::current_exception();
+		    }
+		}));
+    }
+    for (auto &worker : workers)
+	worker.join();
+    for (auto &error : errors) {
+	if (error)
+	    std::rethrow_exception(error);
+    }
+    // a file mapped to content that failed to decode elsewhere goes too
+    std::map<std::string, std::string> failed;
+    for (size_t n = 0; n < reasons.size(); n ++) {
+	if (!reasons[n].empty() && !hashes[n].empty())
+	    failed[hashes[n]] = reasons[n];
+    }
+    for (size_t n = 0; n < reasons.size(); n ++) {
+	auto it = failed.find(hashes[n]);
+	if (reasons[n].empty() && it != failed.end()) {
+	    segments[owners[n]]->unregister_path(paths[n]);
+	    reasons[n] = it->second;
+	}
+	if (!reasons[n].empty())
+	    skipped->push_back(std::make_pair(paths[n], reasons[n]));
+    }
 
-    register_path(filepath, hash);
+    driver_->begin_batch();
+    try {
+	for (auto &segment : segments)
+	    driver_->merge(*segment);
+    } catch (...) {
+	driver_->rollback_batch();
+	throw;
+    }
+    driver_->commit_batch();
 }
 
 void Dictionary::add(const Record &rec)
 {
     driver_->add(rec);
+    Metrics::instance().add(Metrics::RECORDS_INSERTED);
+}
+
+namespace {
+    // One bigram of a query: its postings and its byte offset in the query.
+    struct Term {
+	std::shared_ptr<const PostingList> list;
+	uint32_t offset;
+    };
+
+    // Intersects ascending document sets, smallest first, each step
+    // searching forward from where the previous match was found.
+    std::vector<uint32_t> intersect(std::vector<const std::vector<uint32_t>*> sets)
+    {
+	std::sort(sets.begin(), sets.end(),
+		  [](const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) {
+		      return a->size() < b->size();
+		  });
+	std::vector<uint32_t> dest = *sets.front();
+	for (size_t i = 1; i < sets.size() && !dest.empty(); i ++) {
+	    auto from = sets[i]->cbegin();
+	    auto out = dest.begin();
+	    for (auto document : dest) {
+		from = std::lower_bound(from, sets[i]->cend(), document);
+		if (from == sets[i]->cend())
+		    break;
+		if (*from == document)
+		    *out++ = document;
+	    }
+	    dest.erase(out, dest.end());
+	}
+	return dest;
+    }
+
+    // Finds where all terms occur at their offsets from a common start.
+    // Candidates come from the rarest bigram; the others are only probed
+    // at the offsets the candidates imply, skipping everything in between.
+    std::list<Position> match(std::vector<Term> terms)
+    {
+	std::list<Position> dest;
+	if (terms.empty())
+	    return dest;
+
+	std::stable_sort(terms.begin(), terms.end(), [](const Term &a, const Term &b) {
+		return a.list->size() < b.list->size();
+	    });
+	const Term &rarest = terms.front();
+	std::vector<PostingList::Cursor> cursors;
+	for (auto it = terms.cbegin() + 1; it != terms.cend(); it ++)
+	    cursors.push_back(it->list->cursor());
+
+	auto cur = rarest.list->cursor();
+	while (cur.valid()) {
+	    if (cur.position() < rarest.offset) {
+		cur.seek(cur.document(), rarest.offset);
+		continue;
+	    }
+	    uint32_t document = cur.document();
+	    uint32_t start = cur.position() - rarest.offset;
+
+	    bool match = true;
+	    for (size_t i = 0; i < cursors.size(); i ++) {
+		uint32_t offset = terms[i + 1].offset;
+		auto &other = cursors[i];
+		if (!other.seek(document, start + offset))
+		    return dest;
+		if (other.document() == document && other.position() == start + offset)
+		    continue;
+
+		// leap the candidate cursor to the next start this bigram allows
+		match = false;
+		uint32_t next_start = other.position() < offset ? 0 : other.position() - offset;
+		cur.seek(other.document(), next_start + rarest.offset);
+		break;
+	    }
+	    if (match) {
+		dest.push_back(Position(document, start));
+		cur.next();
+	    }
+	}
+	return dest;
+    }
 }
 
 std::list<Position>
 Dictionary::search(const std::string &text) const
 {
-    std::map<Position, int> map;
+    return search_many(std::vector<std::string>(1, text), 1).front();
+}
+
+std::vector<std::list<Position>>
+Dictionary::search_many(const std::vector<std::string> &texts, unsigned threads) const
+{
+    Metrics::Timer timer(texts.size() == 1 ? Metrics::SEARCH_LATENCY
+			 : Metrics::SEARCH_BATCH_LATENCY);
+
+    // the bigrams of each query at their offsets, and each distinct bigram
+    // of all queries once
+    std::vector<std::vector<std::pair<size_t, uint32_t>>> queries(texts.size());
+    std::map<std::pair<int, int>, size_t> slots;
+    std::vector<std::pair<int, int>> keys;
+    for (size_t q = 0; q < texts.size(); q ++) {
+	for (BigramCursor bg(texts[q]); bg.valid(); bg.next()) {
+	    auto key = std::make_pair(bg.first(), bg.second());
+	    auto slot = slots.insert(std::make_pair(key, keys.size()));
+	    if (slot.second)
+		keys.push_back(key);
+	    queries[q].push_back(std::make_pair(slot.first->second, uint32_t(bg.offset())));
+	}
+    }
 
-    auto chars = disassemble(text);
-    for (int i = 0; i < chars.size() - 1; i ++) {
-        auto recs = lookup(chars[i].first, chars[i + 1].first);
-        for (auto rec : recs) {
-	    auto offset = rec.position().position() - chars[i].second;
-	    Position pos(rec.position().docid(), offset);
-            map[pos]++;
-        }
+    // only documents that have every bigram of a query can match it; when
+    // the driver knows them, positions are read for those documents alone
+    std::vector<std::list<Position>> dest(texts.size());
+    std::vector<std::vector<uint32_t>> documents;
+    std::vector<uint32_t> candidates;
+    std::vector<bool> needed(keys.size(), true);
+    bool pruned = !keys.empty() && driver_->documents_batch(keys, documents);
+    if (pruned) {
+	needed.assign(keys.size(), false);
+	for (auto &query : queries) {
+	    if (query.empty())
+		continue;
+	    std::vector<const std::vector<uint32_t>*> sets;
+	    for (auto &term : query)
+		sets.push_back(&documents[term.first]);
+	    auto found = intersect(sets);
+	    if (found.empty()) {
+		query.clear();
+		continue;
+	    }
+	    candidates.insert(candidates.end(), found.cbegin(), found.cend());
+	    for (auto &term : query)
+		needed[term.first] = true;
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
     }
 
-    std::list<std::pair<Position, int>> result(map.cbegin(), map.cend());
-    result.remove_if([&chars](std::pair<Position, int> elem){
-	    return elem.second < chars.size() - 1;
-	});
-    std::list<Position> dest;
-    std::transform(result.cbegin(), result.cend(), std::back_inserter(dest),
-		   [](const std::pair<Position, int> &a){
-		       return a.first;
-		   });
+    std::vector<std::pair<int, int>> fetch;
+    std::vector<size_t> fetched_slots;
+    for (size_t i = 0; i < keys.size(); i ++) {
+	if (needed[i]) {
+	    fetch.push_back(keys[i]);
+	    fetched_slots.push_back(i);
+	}
+    }
+    if (fetch.empty())
+	return dest;
+    std::vector<std::shared_ptr<const PostingList>> lists(keys.size());
+    auto fetched = driver_->postings_batch(fetch, pruned ? &candidates : nullptr);
+    uint64_t scanned = 0;
+    for (size_t i = 0; i < fetch.size(); i ++) {
+	lists[fetched_slots[i]] = fetched[i];
+	scanned += fetched[i]->size();
+    }
+    Metrics &metrics = Metrics::instance();
+    metrics.add(Metrics::LOOKUPS, fetch.size());
+    metrics.add(Metrics::POSTINGS_SCANNED, scanned);
+
+    // queries only read the shared lists, so they are evaluated in parallel
+    auto evaluate = [&](size_t q) {
+	std::vector<Term> terms;
+	for (auto &term : queries[q]) {
+	    Term t = {lists[term.first], term.second};
+	    terms.push_back(t);
+	}
+	dest[q] = match(terms);
+    };
+    if (threads == 0)
+	threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(size_t(threads), texts.size());
+    auto returned = [&dest]() {
+	uint64_t n = 0;
+	for (auto &result : dest)
+	    n += result.size();
+	return n;
+    };
+    if (threads <= 1) {
+	for (size_t q = 0; q < texts.size(); q ++)
+	    evaluate(q);
+	metrics.add(Metrics::POSTINGS_RETURNED, returned());
+	return dest;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i ++) {
+	workers.push_back(std::thread([&, i]() {
+		    try {
+			for (size_t q; (q = next++) < texts.size(); )
+			    evaluate(q);
+		    } catch (...) {
+			errors[i] = std::current_exception();
+		    }
+		}));
+    }
+    for (auto &worker : workers)
+	worker.join();
+    for (auto &error : errors) {
+	if (error)
+	    std::rethrow_exception(error);
+    }
+    metrics.add(Metrics::POSTINGS_RETURNED, returned());
     return dest;
 }
 
-void Dictionary::register_path(const Path &path, const std::string &digest)
+namespace {
+    // One distinct bigram of a ranked query.
+    struct RankedTerm {
+	std::shared_ptr<const PostingList> list;
+	unsigned int weight;	// occurrences in the query
+    };
+
+    // Orders by how good a result is: higher scores first, then earlier
+    // documents.
+    bool better(const ScoredDocument &a, const ScoredDocument &b)
+    {
+	return a.score() > b.score()
+	    || (a.score() == b.score() && a.document() < b.document());
+    }
+}
+
+// Document-at-a-time max-score evaluation. The terms are split at the
+// point where the lists before it together cannot lift a document above
+// the k-th best score so far; only documents of the remaining, essential
+// lists are candidates, and the others are merely probed for them. As the
+// heap fills and its threshold rises, more lists turn non-essential.
+std::vector<ScoredDocument>
+Dictionary::search_ranked(const std::string &text, size_t k) const
+{
+    Metrics::Timer timer(Metrics::SEARCH_LATENCY);
+
+    std::map<std::pair<int, int>, unsigned int> weights;
+    for (BigramCursor bg(text); bg.valid(); bg.next())
+	weights[std::make_pair(bg.first(), bg.second())] ++;
+
+    std::vector<ScoredDocument> heap;
+    if (weights.empty() || k == 0)
+	return heap;
+
+    std::vector<std::pair<int, int>> keys;
+    for (auto &entry : weights)
+	keys.push_back(entry.first);
+    auto lists = driver_->postings_batch(keys);
+
+    std::vector<RankedTerm> terms;
+    uint64_t scanned = 0;
+    for (size_t i = 0; i < keys.size(); i ++) {
+	RankedTerm term = {lists[i], weights[keys[i]]};
+	if (term.list->size() > 0)
+	    terms.push_back(term);
+	scanned += term.list->size();
+    }
+    Metrics &metrics = Metrics::instance();
+    metrics.add(Metrics::LOOKUPS, keys.size());
+    metrics.add(Metrics::POSTINGS_SCANNED, scanned);
+    // cheap upper bounds first and, among equals, long lists, so that the
+    // longest lists are the first to need probing only
+    std::sort(terms.begin(), terms.end(), [](const RankedTerm &a, const RankedTerm &b) {
+	    return a.weight < b.weight
+		|| (a.weight == b.weight && a.list->size() > b.list->size());
+	});
+    // bound[i]: best score a document can get from terms[0, i)
+    std::vector<unsigned int> bound(terms.size() + 1, 0);
+    for (size_t i = 0; i < terms.size(); i ++)
+	bound[i + 1] = bound[i] + terms[i].weight;
+
+    std::vector<PostingList::Cursor> cursors;
+    for (auto &term : terms)
+	cursors.push_back(term.list->cursor());
+
+    unsigned int threshold = 0;
+    size_t essential = 0;
+    auto worse = [](const ScoredDocument &a, const ScoredDocument &b) {return better(a, b);};
+    for (;;) {
+	uint32_t document = UINT32_MAX;
+	bool found = false;
+	for (size_t i = essential; i < cursors.size(); i ++) {
+	    if (cursors[i].valid() && (!found || cursors[i].document() < document)) {
+		document = cursors[i].document();
+		found = true;
+	    }
+	}
+	if (!found)
+	    break;
+
+	unsigned int score = 0;
+	for (size_t i = essential; i < cursors.size(); i ++) {
+	    if (cursors[i].valid() && cursors[i].document() == document) {
+		score += terms[i].weight;
+		cursors[i].seek(document + 1, 0);
+	    }
+	}
+	for (size_t i = essential; i-- > 0; ) {
+	    if (score + bound[i + 1] <= threshold)
+		break;
+	    if (cursors[i].seek(document, 0) && cursors[i].document() == document)
+		score += terms[i].weight;
+	}
+
+	// candidates come in document order, so a tie never displaces
+	if (heap.size() == k && score <= threshold)
+	    continue;
+	heap.push_back(ScoredDocument(document, score));
+	std::push_heap(heap.begin(), heap.end(), worse);
+	if (heap.size() > k) {
+	    std::pop_heap(heap.begin(), heap.end(), worse);
+	    heap.pop_back();
+	}
+	if (heap.size() == k) {
+	    threshold = heap.front().score();
+	    while (essential < terms.size() && bound[essential + 1] <= threshold)
+		essential ++;
+	}
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), worse);
+    metrics.add(Metrics::POSTINGS_RETURNED, heap.size());
+    return heap;
+}
+
+void Dictionary::register_path(const Path &path, const std::string &digest,
+			       const FileInfo &info)
 {
-    driver_->register_path(path, digest);
+    driver_->register_path(path, digest, info);
 }
 
 std::set<Path> Dictionary::lookup_digest(const std::string &digest)
@@ -119,24 +740,205 @@ Record::Record(int char1, int char2, const Position &pos)
 {
 }
 
+DocumentTable& DocumentTable::instance()
+{
+    static DocumentTable table;
+    return table;
+}
+
+uint32_t DocumentTable::intern(const std::string &digest)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = documents_.find(digest);
+    if (it != documents_.end())
+	return it->second;
+
+    uint32_t document = digests_.size();
+    documents_.insert(std::make_pair(digest, document));
+    digests_.push_back(digest);
+    return document;
+}
+
+std::string DocumentTable::digest(uint32_t document) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return digests_.at(document);
+}
+
+bool DocumentTable::find(const std::string &digest, uint32_t &document) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = documents_.find(digest);
+    if (it == documents_.end())
+	return false;
+    document = it->second;
+    return true;
+}
+
+namespace {
+    uint64_t now_nanoseconds()
+    {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Threads beyond this many share slots, which stays correct since the
+    // slots are atomic.
+    const size_t METRICS_SLOTS = 64;
+}
+
+// A cache line each, so that threads do not contend for one.
+struct alignas(64) Metrics::Slot {
+    std::atomic<uint64_t> counters[COUNTERS];
+    std::atomic<uint64_t> buckets[HISTOGRAMS][BUCKETS];
+    std::atomic<uint64_t> nanoseconds[HISTOGRAMS];
+};
+
+// Static storage keeps the slots aligned, which operator new does not
+// promise for over-aligned types before C++17; it also starts them at zero.
+Metrics::Metrics()
+{
+    static Slot slots[METRICS_SLOTS];
+    slots_ = slots;
+}
+
+Metrics& Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+namespace {
+    std::atomic<size_t> next_metrics_slot(0);
+    thread_local size_t metrics_slot = next_metrics_slot++ % METRICS_SLOTS;
+}
+
+void Metrics::add(Counter counter, uint64_t n)
+{
+    slots_[metrics_slot].counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Metrics::observe(Histogram histogram, uint64_t nanoseconds)
+{
+    size_t bucket = 0;
+    for (uint64_t micros = nanoseconds / 1000; micros && bucket < BUCKETS - 1; micros >>= 1)
+	bucket ++;
+    Slot &slot = slots_[metrics_slot];
+    slot.buckets[histogram][bucket].fetch_add(1, std::memory_order_relaxed);
+    slot.nanoseconds[histogram].fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+Metrics::Snapshot Metrics::snapshot() const
+{
+    Snapshot dest;
+    for (size_t i = 0; i < METRICS_SLOTS; i ++) {
+	const Slot &slot = slots_[i];
+	for (size_t c = 0; c < COUNTERS; c ++)
+	    dest.counters[c] += slot.counters[c].load(std::memory_order_relaxed);
+	for (size_t h = 0; h < HISTOGRAMS; h ++) {
+	    for (size_t b = 0; b < BUCKETS; b ++)
+		dest.buckets[h][b] += slot.buckets[h][b].load(std::memory_order_relaxed);
+	    dest.nanoseconds[h] += slot.nanoseconds[h].load(std::memory_order_relaxed);
+	}
+    }
+    return dest;
+}
+
+void Metrics::reset()
+{
+    for (size_t i = 0; i < METRICS_SLOTS; i ++) {
+	Slot &slot = slots_[i];
+	for (size_t c = 0; c < COUNTERS; c ++)
+	    slot.counters[c].store(0, std::memory_order_relaxed);
+	for (size_t h = 0; h < HISTOGRAMS; h ++) {
+	    for (size_t b = 0; b < BUCKETS; b ++)
+		slot.buckets[h][b].store(0, std::memory_order_relaxed);
+	    slot.nanoseconds[h].store(0, std::memory_order_relaxed);
+	}
+    }
+}
+
+Metrics::Timer::Timer(Histogram histogram)
+    : histogram_(histogram), start_(now_nanoseconds())
+{
+}
+
+Metrics::Timer::~Timer()
+{
+    Metrics::instance().observe(histogram_, now_nanoseconds() - start_);
+}
+
+Metrics::Snapshot::Snapshot()
+{
+    std::fill(counters, counters + COUNTERS, 0);
+    std::fill(&buckets[0][0], &buckets[0][0] + HISTOGRAMS * BUCKETS, 0);
+    std::fill(nanoseconds, nanoseconds + HISTOGRAMS, 0);
+}
+
+uint64_t Metrics::Snapshot::count(Histogram histogram) const
+{
+    uint64_t dest = 0;
+    for (size_t b = 0; b < BUCKETS; b ++)
+	dest += buckets[histogram][b];
+    return dest;
+}
+
+std::string Metrics::Snapshot::prometheus() const
+{
+    static const char *counter_names[COUNTERS][2] = {
+	{"bigram_lookups_total", "Posting lists asked of the driver."},
+	{"bigram_postings_scanned_total", "Postings in the lists searches evaluated."},
+	{"bigram_postings_returned_total", "Positions searches returned."},
+	{"bigram_records_inserted_total", "Bigram records added."},
+	{"bigram_disassembled_bytes_total", "Bytes decoded into code points."},
+    };
+    static const char *histogram_names[HISTOGRAMS][2] = {
+	{"bigram_search_duration_seconds", "Time to answer a search."},
+	{"bigram_search_batch_duration_seconds", "Time to answer a batch of searches."},
+	{"bigram_sqlite_transaction_duration_seconds", "Time from BEGIN to COMMIT or ROLLBACK of an SQLite batch."},
+	{"bigram_sqlite_read_duration_seconds", "Time to run an SQLite lookup."},
+    };
+
+    std::ostringstream os;
+    os.precision(9);
+    for (size_t c = 0; c < COUNTERS; c ++) {
+	os << "# HELP " << counter_names[c][0] << " " << counter_names[c][1] << "\n"
+	   << "# TYPE " << counter_names[c][0] << " counter\n"
+	   << counter_names[c][0] << " " << counters[c] << "\n";
+    }
+    for (size_t h = 0; h < HISTOGRAMS; h ++) {
+	const char *name = histogram_names[h][0];
+	os << "# HELP " << name << " " << histogram_names[h][1] << "\n"
+	   << "# TYPE " << name << " histogram\n";
+	uint64_t cumulative = 0;
+	for (size_t b = 0; b < BUCKETS - 1; b ++) {
+	    cumulative += buckets[h][b];
+	    os << name << "_bucket{le=\"" << double(uint64_t(1) << b) / 1e6 << "\"} "
+	       << cumulative << "\n";
+	}
+	cumulative += buckets[h][BUCKETS - 1];
+	os << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+	   << name << "_sum " << nanoseconds[h] / 1e9 << "\n"
+	   << name << "_count " << cumulative << "\n";
+    }
+    return os.str();
+}
+
 bool Position::operator==(const Position &pos) const
 {
-    return this == &pos || pos.docid_ == docid_ && pos.position_ == position_;
+    return pos.document_ == document_ && pos.position_ == position_;
 }
 
 bool Position::operator<(const Position &pos) const
 {
-    if (this == &pos) return false;
-    if (pos.docid_ < docid_) return true;
-    if (pos.docid_ > docid_) return false;
-    if (pos.position_ < position_) return true;
-    return false;
+    if (document_ != pos.document_) return document_ < pos.document_;
+    return position_ < pos.position_;
 }
 
 bool Record::operator==(const Record &rec) const
 {
     return this == &rec
-        || rec.first() == first_ && rec.second() == second_ && rec.position() == position_;
+        || (rec.first() == first_ && rec.second() == second_ && rec.position() == position_);
 }
 
 bool Record::operator<(const Record &rec) const
@@ -165,250 +967,2544 @@ std::ostream& operator<<(std::ostream &os, const Record& rec)
 
 std::vector<std::pair<CodePoint, size_t>> Bigram::disassemble(const std::string &text)
 {
-    auto it = text.cbegin();
-    auto end = text.cend();
+    const char *begin = text.data();
+    const char *it = begin;
+    const char *end = begin + text.size();
     std::vector<std::pair<CodePoint, size_t>> dest;
+    dest.reserve(text.size());
+    Metrics::instance().add(Metrics::BYTES_DISASSEMBLED, text.size());
     while (it != end) {
-        auto offset = it - text.cbegin();
+        auto offset = it - begin;
         int cp = utf8::next(it, end);
         dest.push_back(std::pair<CodePoint, size_t>(CodePoint(cp), offset));
     }
     return dest;
 }
 
-void MemoryDriver::add(const Record &rec)
+BigramCursor::BigramCursor(const char *begin, const char *end)
+    : begin_(begin), p_(begin), end_(end), valid_(false),
+      first_(0), second_(0), offset_(0), second_offset_(0)
 {
-    records_.insert(rec);
+    Metrics::instance().add(Metrics::BYTES_DISASSEMBLED, end - begin);
+    if (p_ == end_)
+	return;
+    decode(second_, second_offset_);
+    next();
 }
 
-std::set<Record> MemoryDriver::lookup(int char1, int char2) const
+BigramCursor::BigramCursor(const std::string &text)
+    : BigramCursor(text.data(), text.data() + text.size())
 {
-    std::set<Record> dest;
-    for (auto &rec : records_) {
-        if (rec.first() == char1 && rec.second() == char2)
-            dest.insert(rec);
-    }
-    return dest;
 }
 
-void MemoryDriver::register_path(const Path &path, const std::string &digest)
+void BigramCursor::decode(int &cp, size_t &offset)
 {
-    path_digest_map_[digest].insert(path);
+    offset = p_ - begin_;
+    if (!(*p_ & 0x80))
+	cp = *p_++;
+    else
+	cp = utf8::next(p_, end_);
 }
 
-std::set<Path> MemoryDriver::lookup_digest(const std::string &digest)
+void BigramCursor::next()
 {
-    return path_digest_map_[digest];
+    valid_ = p_ != end_;
+    if (!valid_)
+	return;
+    first_ = second_;
+    offset_ = second_offset_;
+    decode(second_, second_offset_);
 }
 
-SQLiteDriver::SQLiteDriver(const std::string &filename)
-    : db_(nullptr), insert_statement_(nullptr)
+static void put_varint(std::vector<uint8_t> &dest, uint32_t value)
 {
-    int rc = sqlite3_open(filename.c_str(), &db_);
-    if (rc) {
-	sqlite3_close(db_);
-	throw new std::bad_alloc();
+    while (value >= 0x80) {
+	dest.push_back(uint8_t(value | 0x80));
+	value >>= 7;
     }
+    dest.push_back(uint8_t(value));
+}
 
-    std::ostringstream oss;
-    oss << "CREATE TABLE IF NOT EXISTS dictionary ("
-	<< "first INTEGER, "
-	<< "second INTEGER, "
-	<< "docid VARCHAR(20), "
-	<< "position INTEGER, "
-	<< "PRIMARY KEY(first, second, docid, position)"
-	<< ");";
-    char *zErrMsg;
-    rc = sqlite3_exec(db_, oss.str().c_str(), nullptr, nullptr, &zErrMsg);
-
-    if(rc!=SQLITE_OK){
-	std::string err(zErrMsg);
-	sqlite3_free(zErrMsg);
-	throw err;
+static uint32_t get_varint(const uint8_t *&p)
+{
+    uint32_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+	uint8_t byte = *p++;
+	value |= uint32_t(byte & 0x7f) << shift;
+	if (!(byte & 0x80))
+	    return value;
     }
+}
 
-    try {
-	prepare_insert_statement();
-    } catch (int) {
-	throw std::bad_alloc();
-    }
+PostingList::Cursor::Cursor(const PostingList &list)
+    : doc_(list.document_data()),
+      end_(list.document_data() + list.document_count()),
+      bytes_(list.byte_data()), p_(nullptr), remaining_(0), position_(0)
+{
+    enter();
+}
 
-    {
-	std::ostringstream oss;
-	oss << "CREATE TABLE IF NOT EXISTS path_map ("
-	    << "path VARCHAR(255), "
-	    << "docid VARCHAR(20)"
-	    << ");";
-	char *zErrMsg;
-	rc = sqlite3_exec(db_, oss.str().c_str(), nullptr, nullptr, &zErrMsg);
+void PostingList::Cursor::enter()
+{
+    if (doc_ == end_)
+	return;
+    p_ = bytes_ + doc_->offset;
+    remaining_ = doc_->count - 1;
+    position_ = get_varint(p_);
+}
 
-	if(rc!=SQLITE_OK){
-	    std::string err(zErrMsg);
-	    sqlite3_free(zErrMsg);
-	    throw err;
-	}
+void PostingList::Cursor::next()
+{
+    if (remaining_ > 0) {
+	remaining_ --;
+	position_ += get_varint(p_);
+	return;
+    }
+    doc_ ++;
+    enter();
+}
 
+bool PostingList::Cursor::seek(uint32_t document, uint32_t position)
+{
+    if (doc_ == end_)
+	return false;
+
+    if (doc_->document < document) {
+	// gallop over the document directory, then binary search the last step
+	const Document *lo = doc_ + 1;
+	size_t step = 1;
+	while (lo + step < end_ && (lo + step)->document < document) {
+	    lo += step;
+	    step *= 2;
+	}
+	const Document *hi = lo + step < end_ ? lo + step + 1 : end_;
+	doc_ = std::lower_bound(lo, hi, document, [](const Document &d, uint32_t document) {
+		return d.document < document;
+	    });
+	enter();
+	if (doc_ == end_)
+	    return false;
+    }
+    if (doc_->document > document)
+	return true;
+
+    // the whole document lies before the target: skip it without decoding
+    if (doc_->last < position) {
+	doc_ ++;
+	enter();
+	return valid();
     }
+    while (position_ < position)
+	next();
+    return true;
 }
 
-void SQLiteDriver::prepare_insert_statement()
+std::vector<uint32_t> PostingList::decode(const Document &doc) const
 {
-    std::ostringstream oss;
-    oss << "INSERT INTO dictionary (first, second, docid, position) VALUES "
-	<< "(?, ?, ?, ?)";
+    std::vector<uint32_t> positions;
+    positions.reserve(doc.count);
+    const uint8_t *p = byte_data() + doc.offset;
+    uint32_t position = 0;
+    for (uint32_t i = 0; i < doc.count; i ++) {
+	position += get_varint(p);
+	positions.push_back(position);
+    }
+    return positions;
+}
 
-    int rc = sqlite3_prepare_v2(db_, oss.str().c_str(), oss.str().length(),
-				&insert_statement_, nullptr);
-    if (rc != SQLITE_OK) {
-	throw rc;
+static std::vector<uint8_t> encode(const std::vector<uint32_t> &positions)
+{
+    std::vector<uint8_t> encoded;
+    uint32_t prev = 0;
+    for (auto position : positions) {
+	put_varint(encoded, position - prev);
+	prev = position;
     }
+    return encoded;
 }
 
-void SQLiteDriver::add(const Record &rec)
+// Re-encodes the positions of one document in place, shifting the byte
+// ranges of the documents that follow it.
+void PostingList::replace(std::vector<Document>::iterator doc,
+			  const std::vector<uint32_t> &positions)
 {
-    if (sqlite3_bind_int(insert_statement_, 1, rec.first())) throw;
-    if (sqlite3_bind_int(insert_statement_, 2, rec.second())) throw;
-    if (sqlite3_bind_text(insert_statement_, 3, rec.position().docid().c_str(),
-			  rec.position().docid().length(), nullptr)) throw;
-    if (sqlite3_bind_int(insert_statement_, 4, rec.position().position())) throw;
+    std::vector<uint8_t> encoded = encode(positions);
 
-    int rc = sqlite3_step(insert_statement_);
+    auto next = doc + 1;
+    uint32_t begin = doc->offset;
+    uint32_t end = next == documents_.end() ? bytes_.size() : next->offset;
+    bytes_.erase(bytes_.begin() + begin, bytes_.begin() + end);
+    bytes_.insert(bytes_.begin() + begin, encoded.cbegin(), encoded.cend());
 
-    if (rc != SQLITE_DONE) {
-	std::cout << " error code: " << rc << std::endl;
-	throw rc;
-    }
+    int32_t shift = int32_t(encoded.size()) - int32_t(end - begin);
+    for (auto it = next; it != documents_.end(); it ++)
+	it->offset += shift;
 
-    if (sqlite3_reset(insert_statement_)) throw;
+    size_ += positions.size() - doc->count;
+    doc->count = positions.size();
+    doc->last = positions.back();
 }
 
-std::set<Record> SQLiteDriver::lookup(int char1, int char2) const
+std::shared_ptr<const PostingList>
+PostingList::view(const Document *documents, size_t document_count,
+		  const uint8_t *bytes, size_t byte_count, size_t size,
+		  std::shared_ptr<const void> owner)
 {
-    std::ostringstream oss;
-    oss << "SELECT first, second, docid, position FROM dictionary "
-	<< "WHERE first=" << char1 << " AND second=" << char2;
+    std::shared_ptr<PostingList> list(new PostingList);
+    list->view_documents_ = documents;
+    list->view_document_count_ = document_count;
+    list->view_bytes_ = bytes;
+    list->view_byte_count_ = byte_count;
+    list->size_ = size;
+    list->owner_ = owner;
+    return list;
+}
 
-    std::set<Record> dest;
+void PostingList::remove(uint32_t document)
+{
+    detach();
+    auto doc = std::lower_bound(documents_.begin(), documents_.end(), document,
+				[](const Document &d, uint32_t document) {
+				    return d.document < document;
+				});
+    if (doc == documents_.end() || doc->document != document)
+	return;
+
+    auto r = range(&*doc);
+    uint32_t length = r.second - r.first;
+    bytes_.erase(bytes_.begin() + doc->offset, bytes_.begin() + doc->offset + length);
+    size_ -= doc->count;
+    for (auto it = doc + 1; it != documents_.end(); it ++)
+	it->offset -= length;
+    documents_.erase(doc);
+}
 
-    struct X {
-	X(std::set<Record> &dest, int c1, int c2) : dest_(dest), c1_(c1), c2_(c2) {
-	}
-	int operator()(int argc, char** argv, char** columns) {
-	    for (int i = 0; i < argc; i ++) {
-		std::string fileid;
-		std::istringstream ost(argv[2]);
-		ost >> fileid;
-		std::istringstream ost2(argv[3]);
-		int pos;
-		ost2 >> pos;
-		dest_.insert(Record(c1_, c2_, Bigram::Position(fileid, pos)));
-	    }
-	    return 0;
-	}
-	int c1_, c2_;
-	std::set<Record> &dest_;
-	static int doit(void* self, int argc, char** argv, char** columns) {
-	    return (*((X*)self))(argc, argv, columns);
-	}
-    } callback(dest, char1, char2);
+// Copies a view into storage of its own before it is modified.
+void PostingList::detach()
+{
+    if (!view_bytes_)
+	return;
+    documents_.assign(view_documents_, view_documents_ + view_document_count_);
+    bytes_.assign(view_bytes_, view_bytes_ + view_byte_count_);
+    view_documents_ = nullptr;
+    view_document_count_ = 0;
+    view_bytes_ = nullptr;
+    view_byte_count_ = 0;
+    owner_.reset();
+}
 
-    char *zErrMsg;
-    int rc = sqlite3_exec(
-	db_, oss.str().c_str(),
-	X::doit,
-	&callback, &zErrMsg);
+void PostingList::add(uint32_t document, uint32_t position)
+{
+    detach();
+
+    // Ingestion appends documents and positions in ascending order, which
+    // only ever touches the tail of the stream.
+    if (documents_.empty() || documents_.back().document < document) {
+	Document doc = {document, 1, uint32_t(bytes_.size()), position};
+	documents_.push_back(doc);
+	put_varint(bytes_, position);
+	size_ ++;
+	return;
+    }
 
-    if(rc!=SQLITE_OK){
-	std::string err(zErrMsg);
-	sqlite3_free(zErrMsg);
-	throw err;
+    Document &back = documents_.back();
+    if (back.document == document && back.last < position) {
+	put_varint(bytes_, position - back.last);
+	back.last = position;
+	back.count ++;
+	size_ ++;
+	return;
     }
 
-    return dest;
+    auto doc = std::lower_bound(documents_.begin(), documents_.end(), document,
+				[](const Document &d, uint32_t document) {
+				    return d.document < document;
+				});
+    std::vector<uint32_t> positions;
+    if (doc != documents_.end() && doc->document == document) {
+	positions = decode(*doc);
+	auto it = std::lower_bound(positions.begin(), positions.end(), position);
+	if (it != positions.end() && *it == position)
+	    return;
+	positions.insert(it, position);
+    } else {
+	Document entry = {document, 0, doc == documents_.end()
+			  ? uint32_t(bytes_.size()) : doc->offset, position};
+	doc = documents_.insert(doc, entry);
+	positions.push_back(position);
+    }
+    replace(doc, positions);
 }
 
-void SQLiteDriver::register_path(const Path &path, const std::string &digest)
+std::pair<const uint8_t*, const uint8_t*>
+PostingList::range(const Document *doc) const
 {
-    std::ostringstream oss;
-    oss << "INSERT INTO path_map (path, docid) "
-	<< "VALUES (\"" << std::string(path) << "\", \"" << digest << "\")";
+    const Document *next = doc + 1;
+    const uint8_t *begin = byte_data() + doc->offset;
+    const uint8_t *end = next == document_data() + document_count()
+	? byte_data() + byte_count() : byte_data() + next->offset;
+    return std::make_pair(begin, end);
+}
 
-    char *zErrMsg;
-    int rc = sqlite3_exec(db_, oss.str().c_str(), nullptr, nullptr, &zErrMsg);
+void PostingList::merge(const PostingList &other)
+{
+    if (other.document_count() == 0)
+	return;
+    detach();
+
+    // Segments built from different files usually hold disjoint, later
+    // documents, whose encoded ranges can be appended as they are.
+    const Document *b = other.document_data();
+    const Document *b_end = b + other.document_count();
+    if (documents_.empty() || documents_.back().document < b->document) {
+	uint32_t shift = bytes_.size();
+	for (; b != b_end; b ++) {
+	    Document doc = *b;
+	    doc.offset += shift;
+	    documents_.push_back(doc);
+	}
+	bytes_.insert(bytes_.end(), other.byte_data(), other.byte_data() + other.byte_count());
+	size_ += other.size_;
+	return;
+    }
 
-    if(rc!=SQLITE_OK){
-	std::string err(zErrMsg);
-	sqlite3_free(zErrMsg);
-	throw err;
+    PostingList merged;
+    auto append = [&merged](const PostingList &list, const Document *doc) {
+	auto r = list.range(doc);
+	Document entry = *doc;
+	entry.offset = merged.bytes_.size();
+	merged.documents_.push_back(entry);
+	merged.bytes_.insert(merged.bytes_.end(), r.first, r.second);
+	merged.size_ += doc->count;
+    };
+    const Document *a = documents_.data();
+    const Document *a_end = a + documents_.size();
+    while (a != a_end || b != b_end) {
+	if (b == b_end || (a != a_end && a->document < b->document)) {
+	    append(*this, a ++);
+	} else if (a == a_end || b->document < a->document) {
+	    append(other, b ++);
+	} else {
+	    std::vector<uint32_t> x = decode(*a ++), y = other.decode(*b ++);
+	    std::vector<uint32_t> positions;
+	    std::set_union(x.cbegin(), x.cend(), y.cbegin(), y.cend(),
+			   std::back_inserter(positions));
+	    std::vector<uint8_t> encoded = encode(positions);
+	    Document entry = {(a - 1)->document, uint32_t(positions.size()),
+			      uint32_t(merged.bytes_.size()), positions.back()};
+	    merged.documents_.push_back(entry);
+	    merged.bytes_.insert(merged.bytes_.end(), encoded.cbegin(), encoded.cend());
+	    merged.size_ += positions.size();
+	}
     }
+    std::swap(*this, merged);
 }
 
-std::set<Path> SQLiteDriver::lookup_digest(const std::string &digest)
+void Driver::scan(int char1, int char2,
+		  const std::function<void(uint32_t, uint32_t)> &visitor) const
 {
+    Metrics::instance().add(Metrics::LOOKUPS);
+    auto list = postings(char1, char2);
+    for (auto cur = list->cursor(); cur.valid(); cur.next())
+	visitor(cur.document(), cur.position());
+}
 
-    std::ostringstream oss;
-    oss << "SELECT path FROM path_map "
-	<< "WHERE docid=\"" << digest << "\"";
-
-    std::set<Path> dest;
+std::set<Record> Driver::lookup(int char1, int char2) const
+{
+    // Record orders positions descending, so each posting, coming in
+    // ascending order, goes to the front of the tree
+    std::set<Record> dest;
+    scan(char1, char2, [&dest, char1, char2](uint32_t document, uint32_t position) {
+	    dest.insert(dest.begin(), Record(char1, char2, Position(document, position)));
+	});
+    return dest;
+}
 
-    struct X {
-	X(std::set<Path> &dest) : dest_(dest) {
+std::vector<std::shared_ptr<const PostingList>>
+Driver::postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+		       const std::vector<uint32_t>*) const
+{
+    std::vector<std::shared_ptr<const PostingList>> dest;
+    for (auto &bg : bigrams)
+	dest.push_back(postings(bg.first, bg.second));
+    return dest;
+}
+
+bool Driver::documents_batch(const std::vector<std::pair<int, int>> &,
+			     std::vector<std::vector<uint32_t>> &) const
+{
+    return false;
+}
+
+void Driver::add_batch(const std::vector<Record> &recs)
+{
+    begin_batch();
+    try {
+	for (auto &rec : recs)
+	    add(rec);
+    } catch (...) {
+	rollback_batch();
+	throw;
+    }
+    commit_batch();
+}
+
+// Postings are added a document at a time, as add_file() would, so
+// that drivers which keep per-document state between adds (the docid,
+// the bigrams already noted for it) do not reset it on every posting.
+// The segment's lists are merged on their document order.
+void Driver::merge(const MemoryDriver &segment)
+{
+    std::vector<std::pair<std::pair<int, int>, PostingList::Cursor>> cursors;
+    segment.for_each([&cursors](int char1, int char2, const PostingList &list) {
+	    auto cur = list.cursor();
+	    if (cur.valid())
+		cursors.push_back(std::make_pair(std::make_pair(char1, char2), cur));
+	});
+    typedef std::pair<uint32_t, size_t> Head;	// document, cursor
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    for (size_t i = 0; i < cursors.size(); i ++)
+	heads.push(Head(cursors[i].second.document(), i));
+
+    begin_batch();
+    try {
+	while (!heads.empty()) {
+	    Head head = heads.top();
+	    heads.pop();
+	    auto &bigram = cursors[head.second].first;
+	    auto &cur = cursors[head.second].second;
+	    for (; cur.valid() && cur.document() == head.first; cur.next())
+		add(Record(bigram.first, bigram.second, Position(head.first, cur.position())));
+	    if (cur.valid())
+		heads.push(Head(cur.document(), head.second));
+	}
+	segment.for_each_path([this](const Path &path, const std::string &digest,
+				     const FileInfo &info) {
+		register_path(path, digest, info);
+	    });
+    } catch (...) {
+	rollback_batch();
+	throw;
+    }
+    commit_batch();
+}
+
+Arena::Arena(const Options &options)
+    : options_(options), next_(nullptr), end_(nullptr), capacity_(0), used_(0)
+{
+}
+
+Arena::~Arena()
+{
+    for (auto &block : blocks_) {
+	if (options_.huge_pages)
+	    munmap(block.first, block.second);
+	else
+	    ::operator delete(block.first);
+    }
+}
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+    uintptr_t p = (uintptr_t(next_) + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (!next_ || p + size > uintptr_t(end_)) {
+	grow(size + alignment);
+	p = (uintptr_t(next_) + alignment - 1) & ~uintptr_t(alignment - 1);
+    }
+    next_ = (char*)(p + size);
+    used_ += size;
+    return (void*)p;
+}
+
+void Arena::reset()
+{
+    if (blocks_.empty())
+	return;
+    for (size_t i = 1; i < blocks_.size(); i ++) {
+	if (options_.huge_pages)
+	    munmap(blocks_[i].first, blocks_[i].second);
+	else
+	    ::operator delete(blocks_[i].first);
+    }
+    blocks_.resize(1);
+    next_ = (char*)blocks_[0].first;
+    end_ = next_ + blocks_[0].second;
+    capacity_ = blocks_[0].second;
+    used_ = 0;
+}
+
+// Starts a new block; what is left of the current one is given up.
+void Arena::grow(size_t size)
+{
+    size_t length = std::max(size, options_.block_size);
+    void *block;
+    if (options_.huge_pages) {
+	const size_t huge_page = 1 << 21;
+	length = (length + huge_page - 1) & ~(huge_page - 1);
+	block = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED)
+	    throw std::bad_alloc();
+#if defined(MADV_HUGEPAGE)
+	madvise(block, length, MADV_HUGEPAGE);
+#endif
+    } else {
+	block = ::operator new(length);
+    }
+    blocks_.push_back(std::make_pair(block, length));
+    next_ = (char*)block;
+    end_ = next_ + length;
+    capacity_ += length;
+}
+
+MemoryDriver::MemoryDriver(const Arena::Options &options)
+    : options_(options), arena_(new Arena(options))
+{
+}
+
+// Every list allocated from the arena holds a reference to it, so the
+// arena is only shared once the table is empty if a list is still out.
+void MemoryDriver::clear()
+{
+    postings_.clear();
+    path_digest_map_.clear();
+    path_info_.clear();
+    if (arena_.use_count() == 1)
+	arena_->reset();
+    else
+	arena_.reset(new Arena(options_));
+}
+
+uint64_t MemoryDriver::key(int char1, int char2)
+{
+    return (uint64_t(uint32_t(char1)) << 32) | uint32_t(char2);
+}
+
+void MemoryDriver::merge(const MemoryDriver &segment)
+{
+    for (auto &entry : segment.postings_) {
+	auto &list = postings_[entry.first];
+	if (!list)
+	    list = std::allocate_shared<PostingList>(ArenaAllocator<PostingList>(arena_),
+						     *entry.second);
+	else
+	    list->merge(*entry.second);
+    }
+    for (auto &entry : segment.path_info_)
+	register_path(entry.first, entry.second.first, entry.second.second);
+}
+
+void MemoryDriver::for_each(const std::function<void(int, int, const PostingList&)> &visitor) const
+{
+    for (auto &entry : postings_)
+	visitor(int(entry.first >> 32), int(uint32_t(entry.first)), *entry.second);
+}
+
+size_t MemoryDriver::memory_usage() const
+{
+    size_t bytes = arena_->capacity();
+    for (auto &entry : postings_) {
+	auto &list = *entry.second;
+	bytes += list.document_count() * sizeof(PostingList::Document) + list.byte_count();
+    }
+    return bytes;
+}
+
+void MemoryDriver::for_each_path(const std::function<void(const Path&, const std::string&,
+							  const FileInfo&)> &visitor) const
+{
+    for (auto &entry : path_info_)
+	visitor(entry.first, entry.second.first, entry.second.second);
+}
+
+void MemoryDriver::add(const Record &rec)
+{
+    auto &list = postings_[key(rec.first(), rec.second())];
+    if (!list)
+	list = std::allocate_shared<PostingList>(ArenaAllocator<PostingList>(arena_));
+    list->add(rec.position().document(), rec.position().position());
+}
+
+std::shared_ptr<const PostingList> MemoryDriver::postings(int char1, int char2) const
+{
+    static const std::shared_ptr<const PostingList> empty(new PostingList);
+    auto it = postings_.find(key(char1, char2));
+    if (it == postings_.end())
+	return empty;
+    return it->second;
+}
+
+void MemoryDriver::register_path(const Path &path, const std::string &digest,
+				 const FileInfo &info)
+{
+    unregister_path(path);
+    path_digest_map_[digest].insert(path);
+    path_info_[path] = std::make_pair(digest, info);
+}
+
+bool MemoryDriver::lookup_path(const Path &path, std::string &digest, FileInfo &info)
+{
+    auto it = path_info_.find(path);
+    if (it == path_info_.end())
+	return false;
+    digest = it->second.first;
+    info = it->second.second;
+    return true;
+}
+
+void MemoryDriver::unregister_path(const Path &path)
+{
+    auto it = path_info_.find(path);
+    if (it == path_info_.end())
+	return;
+    auto paths = path_digest_map_.find(it->second.first);
+    paths->second.erase(path);
+    if (paths->second.empty())
+	path_digest_map_.erase(paths);
+    path_info_.erase(it);
+}
+
+// Visits every bigram; there is no per-document index of the bigrams a
+// document contains.
+void MemoryDriver::remove_document(const std::string &digest)
+{
+    uint32_t document;
+    if (!DocumentTable::instance().find(digest, document))
+	return;
+    for (auto it = postings_.begin(); it != postings_.end(); ) {
+	it->second->remove(document);
+	if (it->second->size() == 0)
+	    it = postings_.erase(it);
+	else
+	    ++ it;
+    }
+}
+
+std::set<Path> MemoryDriver::lookup_digest(const std::string &digest)
+{
+    auto it = path_digest_map_.find(digest);
+    if (it == path_digest_map_.end())
+	return std::set<Path>();
+    return it->second;
+}
+
+SnapshotDriver::SnapshotDriver(const Options &options)
+    : options_(options), delta_(new MemoryDriver(options.arena)), delta_size_(0)
+{
+    std::shared_ptr<Snapshot> empty(new Snapshot);
+    std::shared_ptr<const Shard> shard(new Shard);
+    for (auto &s : empty->shards)
+	s = shard;
+    snapshot_ = empty;
+}
+
+uint64_t SnapshotDriver::key(int char1, int char2)
+{
+    return (uint64_t(uint32_t(char1)) << 32) | uint32_t(char2);
+}
+
+size_t SnapshotDriver::shard(uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 58;
+}
+
+std::shared_ptr<const SnapshotDriver::Snapshot> SnapshotDriver::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(snapshot_mutex_);
+    return snapshot_;
+}
+
+void SnapshotDriver::swap(const std::shared_ptr<const Snapshot> &snapshot)
+{
+    std::shared_ptr<const Snapshot> old;
+    {
+	std::lock_guard<std::mutex> lock(snapshot_mutex_);
+	old = snapshot_;
+	snapshot_ = snapshot;
+    }
+    // the old snapshot, if this was its last user, goes outside the lock
+}
+
+std::shared_ptr<const PostingList> SnapshotDriver::find(const Snapshot &snapshot,
+							int char1, int char2)
+{
+    static const std::shared_ptr<const PostingList> empty(new PostingList);
+    uint64_t k = key(char1, char2);
+    auto &s = *snapshot.shards[shard(k)];
+    auto it = s.find(k);
+    if (it == s.end())
+	return empty;
+    return it->second.list;
+}
+
+// Moves the postings into a new store with room for as many again.
+SnapshotDriver::Entry SnapshotDriver::copy(const PostingList &list)
+{
+    Entry entry;
+    entry.store.reset(new Store);
+    entry.store->documents.reserve(std::max<size_t>(2 * list.document_count(), 4));
+    entry.store->documents.assign(list.document_data(),
+				  list.document_data() + list.document_count());
+    entry.store->bytes.reserve(std::max<size_t>(2 * list.byte_count(), 16));
+    entry.store->bytes.assign(list.byte_data(), list.byte_data() + list.byte_count());
+    entry.store->size = list.size();
+    publish_view(entry);
+    return entry;
+}
+
+// Adds `list` after the end of the entry's store if its documents come
+// later and it fits in the room left, so nothing moves under a reader.
+bool SnapshotDriver::append(Entry &entry, const PostingList &list)
+{
+    auto &store = entry.store;
+    if (!store || store->documents.size() != entry.list->document_count())
+	return false;
+    auto &documents = store->documents;
+    auto &bytes = store->bytes;
+    if (documents.capacity() - documents.size() < list.document_count() ||
+	bytes.capacity() - bytes.size() < list.byte_count())
+	return false;
+    if (list.document_count() > 0 && !documents.empty() &&
+	list.document_data()->document <= documents.back().document)
+	return false;
+
+    uint32_t shift = bytes.size();
+    for (size_t i = 0; i < list.document_count(); i ++) {
+	PostingList::Document doc = list.document_data()[i];
+	doc.offset += shift;
+	documents.push_back(doc);
+    }
+    bytes.insert(bytes.end(), list.byte_data(), list.byte_data() + list.byte_count());
+    store->size += list.size();
+    publish_view(entry);
+    return true;
+}
+
+void SnapshotDriver::publish_view(Entry &entry)
+{
+    auto &store = *entry.store;
+    entry.list = PostingList::view(store.documents.data(), store.documents.size(),
+				   store.bytes.data(), store.bytes.size(),
+				   store.size, entry.store);
+}
+
+std::shared_ptr<const PostingList> SnapshotDriver::postings(int char1, int char2) const
+{
+    return find(*snapshot(), char1, char2);
+}
+
+// All lists of a query come from the same snapshot.
+std::vector<std::shared_ptr<const PostingList>>
+SnapshotDriver::postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+			       const std::vector<uint32_t>*) const
+{
+    auto snap = snapshot();
+    std::vector<std::shared_ptr<const PostingList>> dest;
+    dest.reserve(bigrams.size());
+    for (auto &bg : bigrams)
+	dest.push_back(find(*snap, bg.first, bg.second));
+    return dest;
+}
+
+std::shared_ptr<MemoryDriver> SnapshotDriver::staging()
+{
+    if (spare_.empty())
+	return std::shared_ptr<MemoryDriver>(new MemoryDriver(options_.arena));
+    auto driver = spare_.back();
+    spare_.pop_back();
+    return driver;
+}
+
+void SnapshotDriver::recycle(const std::shared_ptr<MemoryDriver> &driver)
+{
+    driver->clear();
+    spare_.push_back(driver);
+}
+
+void SnapshotDriver::begin_batch()
+{
+    writer_mutex_.lock();
+    if (batches_.empty()) {
+	std::lock_guard<std::mutex> lock(path_mutex_);
+	writer_ = std::this_thread::get_id();
+    }
+    batches_.push_back(Batch());
+    batches_.back().postings = staging();
+}
+
+// An inner batch is folded into the one around it, the outermost into
+// the delta.
+void SnapshotDriver::commit_batch()
+{
+    Batch batch = batches_.back();
+    batches_.pop_back();
+    if (!batches_.empty()) {
+	auto &outer = batches_.back();
+	outer.postings->merge(*batch.postings);
+	outer.paths.insert(outer.paths.end(), batch.paths.begin(), batch.paths.end());
+	recycle(batch.postings);
+    } else {
+	batch.postings->for_each([this](int, int, const PostingList &list) {
+		delta_size_ += list.size();
+	    });
+	delta_->merge(*batch.postings);
+	delta_paths_.insert(delta_paths_.end(), batch.paths.begin(), batch.paths.end());
+	recycle(batch.postings);
+	{
+	    std::lock_guard<std::mutex> lock(path_mutex_);
+	    writer_ = std::thread::id();
+	}
+	if (delta_size_ >= options_.publish_threshold)
+	    publish_delta();
+    }
+    writer_mutex_.unlock();
+}
+
+void SnapshotDriver::rollback_batch()
+{
+    recycle(batches_.back().postings);
+    batches_.pop_back();
+    if (batches_.empty()) {
+	std::lock_guard<std::mutex> lock(path_mutex_);
+	writer_ = std::thread::id();
+    }
+    writer_mutex_.unlock();
+}
+
+void SnapshotDriver::add(const Record &rec)
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex_);
+    if (!batches_.empty()) {
+	batches_.back().postings->add(rec);
+	return;
+    }
+    delta_->add(rec);
+    if (++delta_size_ >= options_.publish_threshold)
+	publish_delta();
+}
+
+void SnapshotDriver::merge(const MemoryDriver &segment)
+{
+    begin_batch();
+    try {
+	batches_.back().postings->merge(segment);
+	segment.for_each_path([this](const Path &path, const std::string &digest,
+				     const FileInfo &info) {
+		change_path(PathChange(path, true, digest, info));
+	    });
+    } catch (...) {
+	rollback_batch();
+	throw;
+    }
+    commit_batch();
+}
+
+void SnapshotDriver::publish()
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex_);
+    publish_delta();
+}
+
+// Copies the shards the delta touches, appends the delta to their lists
+// and swaps the result in. Untouched shards are shared with the previous
+// snapshot. A list whose store is full, or that the delta does not simply
+// extend, is merged into a new store twice its size, so each posting is
+// copied a constant number of times on average.
+void SnapshotDriver::publish_delta()
+{
+    if (delta_size_ > 0) {
+	auto old = snapshot();
+	std::shared_ptr<Snapshot> next(new Snapshot(*old));
+	std::shared_ptr<Shard> touched[SHARDS];
+	delta_->for_each([&](int char1, int char2, const PostingList &list) {
+		uint64_t k = key(char1, char2);
+		size_t i = shard(k);
+		if (!touched[i])
+		    touched[i].reset(new Shard(*old->shards[i]));
+		auto &entry = (*touched[i])[k];
+		if (append(entry, list))
+		    return;
+		if (!entry.list) {
+		    entry = copy(list);
+		    return;
+		}
+		PostingList merged(*entry.list);
+		merged.merge(list);
+		entry = copy(merged);
+	    });
+	for (size_t i = 0; i < SHARDS; i ++) {
+	    if (touched[i])
+		next->shards[i] = touched[i];
+	}
+	swap(next);
+
+	// the postings were copied into the stores, none of the delta's is out
+	delta_->clear();
+	delta_size_ = 0;
+    }
+
+    // paths only once the postings they lead to can be found
+    std::lock_guard<std::mutex> lock(path_mutex_);
+    for (auto &change : delta_paths_) {
+	if (change.registered)
+	    paths_.register_path(change.path, change.digest, change.info);
+	else
+	    paths_.unregister_path(change.path);
+    }
+    delta_paths_.clear();
+}
+
+// Publishes what is pending, then copies every list the document is in;
+// the copies leave their stores and move to new ones when next added to.
+void SnapshotDriver::remove_document(const std::string &digest)
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex_);
+    publish_delta();
+
+    uint32_t document;
+    if (!DocumentTable::instance().find(digest, document))
+	return;
+    auto old = snapshot();
+    std::shared_ptr<Snapshot> next(new Snapshot(*old));
+    for (size_t i = 0; i < SHARDS; i ++) {
+	std::shared_ptr<Shard> copy;
+	for (auto &entry : *old->shards[i]) {
+	    auto cur = entry.second.list->cursor();
+	    if (!cur.seek(document, 0) || cur.document() != document)
+		continue;
+	    if (!copy)
+		copy.reset(new Shard(*old->shards[i]));
+	    std::shared_ptr<PostingList> list(new PostingList(*entry.second.list));
+	    list->remove(document);
+	    if (list->size() == 0) {
+		copy->erase(entry.first);
+	    } else {
+		auto &changed = (*copy)[entry.first];
+		changed.list = list;
+		changed.store.reset();
+	    }
+	}
+	if (copy)
+	    next->shards[i] = copy;
+    }
+    swap(next);
+}
+
+// Path changes wait with the postings of their batch, or in the delta.
+void SnapshotDriver::change_path(const PathChange &change)
+{
+    std::lock_guard<std::recursive_mutex> lock(writer_mutex_);
+    if (batches_.empty())
+	delta_paths_.push_back(change);
+    else
+	batches_.back().paths.push_back(change);
+}
+
+// The thread with batches open holds writer_mutex_, so it alone may
+// read the pending changes, and has to in order to find what it added.
+bool SnapshotDriver::pending_paths_visible()
+{
+    return writer_ == std::this_thread::get_id();
+}
+
+void SnapshotDriver::register_path(const Path &path, const std::string &digest,
+				   const FileInfo &info)
+{
+    change_path(PathChange(path, true, digest, info));
+}
+
+std::set<Path> SnapshotDriver::lookup_digest(const std::string &digest)
+{
+    std::lock_guard<std::mutex> lock(path_mutex_);
+    auto dest = paths_.lookup_digest(digest);
+    if (!pending_paths_visible())
+	return dest;
+
+    auto apply = [&dest, &digest](const PathChange &change) {
+	if (change.registered && change.digest == digest)
+	    dest.insert(change.path);
+	else
+	    dest.erase(change.path);
+    };
+    for (auto &change : delta_paths_)
+	apply(change);
+    for (auto &batch : batches_) {
+	for (auto &change : batch.paths)
+	    apply(change);
+    }
+    return dest;
+}
+
+bool SnapshotDriver::lookup_path(const Path &path, std::string &digest, FileInfo &info)
+{
+    std::lock_guard<std::mutex> lock(path_mutex_);
+    if (pending_paths_visible()) {
+	const PathChange *last = nullptr;
+	for (auto &change : delta_paths_) {
+	    if (!(change.path < path) && !(path < change.path))
+		last = &change;
 	}
-	int operator()(int argc, char** argv, char** columns) {
-	    for (int i = 0; i < argc; i ++) {
-		std::string path;
-		std::istringstream ost(argv[0]);
-		ost >> path;
-		dest_.insert(Path(path));
+	for (auto &batch : batches_) {
+	    for (auto &change : batch.paths) {
+		if (!(change.path < path) && !(path < change.path))
+		    last = &change;
 	    }
-	    return 0;
 	}
-	int c1_, c2_;
-	std::set<Path> &dest_;
-	static int doit(void* self, int argc, char** argv, char** columns) {
-	    return (*((X*)self))(argc, argv, columns);
+	if (last) {
+	    if (!last->registered)
+		return false;
+	    digest = last->digest;
+	    info = last->info;
+	    return true;
 	}
-    } callback(dest);
+    }
+    return paths_.lookup_path(path, digest, info);
+}
+
+void SnapshotDriver::unregister_path(const Path &path)
+{
+    change_path(PathChange(path, false, std::string(), FileInfo()));
+}
+
+SQLiteDriver::SQLiteDriver(const std::string &filename, const Options &options)
+    : db_(nullptr), insert_statement_(nullptr), lookup_statement_(nullptr),
+      register_statement_(nullptr), lookup_digest_statement_(nullptr),
+      lookup_path_statement_(nullptr), unregister_statement_(nullptr),
+      remove_document_statement_(nullptr), insert_document_statement_(nullptr),
+      documents_statement_(nullptr), document_postings_statement_(nullptr),
+      remove_bigram_documents_statement_(nullptr),
+      batch_depth_(0), batch_start_(0), last_document_(0)
+{
+    int rc = sqlite3_open(filename.c_str(), &db_);
+    if (rc) {
+	sqlite3_close(db_);
+	throw new std::bad_alloc();
+    }
+
+    std::ostringstream pragmas;
+    pragmas << "PRAGMA journal_mode=" << options.journal_mode << ";"
+	    << "PRAGMA synchronous=" << options.synchronous << ";"
+	    << "PRAGMA cache_size=" << options.cache_size << ";";
+    exec(pragmas.str());
+
+    // the primary key is the table itself, so the postings of a bigram
+    // are stored next to each other
+    std::ostringstream oss;
+    oss << "CREATE TABLE IF NOT EXISTS dictionary ("
+	<< "first INTEGER, "
+	<< "second INTEGER, "
+	<< "docid BLOB, "
+	<< "position INTEGER, "
+	<< "PRIMARY KEY(first, second, docid, position)"
+	<< ") WITHOUT ROWID;";
+    exec(oss.str());
+
+    {
+	std::ostringstream oss;
+	oss << "CREATE TABLE IF NOT EXISTS path_map ("
+	    << "path TEXT PRIMARY KEY, "
+	    << "docid BLOB, "
+	    << "size INTEGER, "
+	    << "mtime INTEGER, "
+	    << "inode INTEGER"
+	    << ");"
+	    << "CREATE INDEX IF NOT EXISTS path_map_docid ON path_map (docid);"
+	    // lets remove_document find a document's postings without a scan
+	    << "CREATE INDEX IF NOT EXISTS dictionary_docid ON dictionary (docid);";
+	exec(oss.str());
+    }
+
+    {
+	// the documents of each bigram, without positions, to narrow a
+	// query down before any position is read
+	std::ostringstream oss;
+	oss << "CREATE TABLE IF NOT EXISTS bigram_document ("
+	    << "first INTEGER, "
+	    << "second INTEGER, "
+	    << "docid BLOB, "
+	    << "PRIMARY KEY(first, second, docid)"
+	    << ") WITHOUT ROWID;"
+	    << "CREATE INDEX IF NOT EXISTS bigram_document_docid ON bigram_document (docid);"
+	    // databases from before the table get it filled once
+	    << "INSERT OR IGNORE INTO bigram_document (first, second, docid) "
+	    << "SELECT DISTINCT first, second, docid FROM dictionary "
+	    << "WHERE NOT EXISTS (SELECT 1 FROM bigram_document);";
+	exec(oss.str());
+    }
+
+    // re-adding a posting or a path is not an error
+    insert_statement_ = prepare("INSERT OR IGNORE INTO dictionary (first, second, docid, position) "
+				"VALUES (?, ?, ?, ?)");
+    lookup_statement_ = prepare("SELECT docid, position FROM dictionary "
+				"WHERE first=? AND second=?");
+    register_statement_ = prepare("INSERT OR REPLACE INTO path_map (path, docid, size, mtime, inode) "
+				  "VALUES (?, ?, ?, ?, ?)");
+    lookup_digest_statement_ = prepare("SELECT path FROM path_map WHERE docid=?");
+    lookup_path_statement_ = prepare("SELECT docid, size, mtime, inode FROM path_map WHERE path=?");
+    unregister_statement_ = prepare("DELETE FROM path_map WHERE path=?");
+    remove_document_statement_ = prepare("DELETE FROM dictionary WHERE docid=?");
+    insert_document_statement_ = prepare("INSERT OR IGNORE INTO bigram_document (first, second, docid) "
+					 "VALUES (?, ?, ?)");
+    documents_statement_ = prepare("SELECT docid FROM bigram_document WHERE first=? AND second=?");
+    document_postings_statement_ = prepare("SELECT position FROM dictionary "
+					   "WHERE first=? AND second=? AND docid=?");
+    remove_bigram_documents_statement_ = prepare("DELETE FROM bigram_document WHERE docid=?");
+}
 
+SQLiteDriver::~SQLiteDriver()
+{
+    sqlite3_finalize(insert_statement_);
+    sqlite3_finalize(lookup_statement_);
+    sqlite3_finalize(register_statement_);
+    sqlite3_finalize(lookup_digest_statement_);
+    sqlite3_finalize(lookup_path_statement_);
+    sqlite3_finalize(unregister_statement_);
+    sqlite3_finalize(remove_document_statement_);
+    sqlite3_finalize(insert_document_statement_);
+    sqlite3_finalize(documents_statement_);
+    sqlite3_finalize(document_postings_statement_);
+    sqlite3_finalize(remove_bigram_documents_statement_);
+    sqlite3_close(db_);
+}
+
+void SQLiteDriver::exec(const std::string &sql)
+{
     char *zErrMsg;
-    int rc = sqlite3_exec(
-	db_, oss.str().c_str(),
-	X::doit,
-	&callback, &zErrMsg);
+    int rc = sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &zErrMsg);
 
     if(rc!=SQLITE_OK){
 	std::string err(zErrMsg);
 	sqlite3_free(zErrMsg);
 	throw err;
     }
+}
 
-    return dest;
+sqlite3_stmt* SQLiteDriver::prepare(const std::string &sql)
+{
+    sqlite3_stmt *stmt;
+    check(sqlite3_prepare_v2(db_, sql.c_str(), sql.length(), &stmt, nullptr));
+    return stmt;
 }
 
-std::string Bigram::digest_file(const std::string &path)
+void SQLiteDriver::check(int rc) const
 {
-    std::ifstream is(path);
-    SHA_CTX c;
-    SHA1_Init(&c);
+    if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE)
+	throw std::string(sqlite3_errmsg(db_));
+}
 
-    std::string line;
-    while (std::getline(is, line)) {
-	SHA1_Update(&c, line.c_str(), line.length());
+namespace {
+    // Leaves a cached statement ready for the next use however the
+    // current one ends.
+    class StatementScope {
+    public:
+	StatementScope(sqlite3_stmt *stmt) : stmt_(stmt) {}
+	~StatementScope() {
+	    sqlite3_reset(stmt_);
+	    sqlite3_clear_bindings(stmt_);
+	}
+    private:
+	sqlite3_stmt *stmt_;
+    };
+}
+
+// Nested batches are savepoints, so rolling one back undoes its own
+// work only and the enclosing batch can still commit the rest.
+// Writes are timed per transaction rather than per statement, so that
+// the clock is read twice per batch and not twice per INSERT; reads are
+// timed per lookup.
+void SQLiteDriver::begin_batch()
+{
+    if (batch_depth_ == 0) {
+	batch_start_ = now_nanoseconds();
+	exec("BEGIN");
+    } else
+	exec("SAVEPOINT batch_" + std::to_string(batch_depth_));
+    batch_depth_ ++;
+}
+
+void SQLiteDriver::commit_batch()
+{
+    if (--batch_depth_ == 0) {
+	exec("COMMIT");
+	Metrics::instance().observe(Metrics::SQLITE_BATCH_LATENCY, now_nanoseconds() - batch_start_);
+    } else {
+	exec("RELEASE batch_" + std::to_string(batch_depth_));
+    }
+}
+
+void SQLiteDriver::rollback_batch()
+{
+    if (--batch_depth_ == 0) {
+	exec("ROLLBACK");
+	Metrics::instance().observe(Metrics::SQLITE_BATCH_LATENCY, now_nanoseconds() - batch_start_);
+    } else {
+	std::string savepoint = "batch_" + std::to_string(batch_depth_);
+	exec("ROLLBACK TO " + savepoint);
+	exec("RELEASE " + savepoint);
+    }
+    // bigram_document rows of the current document may be gone
+    last_bigrams_.clear();
+}
+
+void SQLiteDriver::add(const Record &rec)
+{
+    // outside a batch an add is a transaction, timed like one
+    if (batch_depth_ == 0) {
+	begin_batch();
+	try {
+	    add(rec);
+	} catch (...) {
+	    rollback_batch();
+	    throw;
+	}
+	commit_batch();
+	return;
+    }
+
+    if (last_docid_.empty() || last_document_ != rec.position().document()) {
+	last_document_ = rec.position().document();
+	last_docid_ = rec.position().docid();
+	last_bigrams_.clear();
+    }
+
+    if (last_bigrams_.insert(std::make_pair(rec.first(), rec.second())).second) {
+	StatementScope scope(insert_document_statement_);
+	check(sqlite3_bind_int(insert_document_statement_, 1, rec.first()));
+	check(sqlite3_bind_int(insert_document_statement_, 2, rec.second()));
+	check(sqlite3_bind_blob(insert_document_statement_, 3, last_docid_.data(),
+				last_docid_.length(), SQLITE_STATIC));
+	check(sqlite3_step(insert_document_statement_));
     }
 
-    unsigned char md[SHA_DIGEST_LENGTH];
-    SHA1_Final(md, &c);
+    StatementScope scope(insert_statement_);
+    check(sqlite3_bind_int(insert_statement_, 1, rec.first()));
+    check(sqlite3_bind_int(insert_statement_, 2, rec.second()));
+    check(sqlite3_bind_blob(insert_statement_, 3, last_docid_.data(),
+			    last_docid_.length(), SQLITE_STATIC));
+    check(sqlite3_bind_int64(insert_statement_, 4, rec.position().position()));
+    check(sqlite3_step(insert_statement_));
+}
+
+std::shared_ptr<const PostingList> SQLiteDriver::postings(int char1, int char2) const
+{
+    Metrics::Timer timer(Metrics::SQLITE_READ_LATENCY);
 
-    return std::string((const char*)md, SHA_DIGEST_LENGTH);
+    // rows come back in digest order, which is not ordinal order
+    std::vector<std::pair<uint32_t, uint32_t>> rows;
+    {
+	StatementScope scope(lookup_statement_);
+	check(sqlite3_bind_int(lookup_statement_, 1, char1));
+	check(sqlite3_bind_int(lookup_statement_, 2, char2));
+
+	std::string docid;
+	uint32_t document = 0;
+	int rc;
+	while ((rc = sqlite3_step(lookup_statement_)) == SQLITE_ROW) {
+	    const char *blob = (const char*)sqlite3_column_blob(lookup_statement_, 0);
+	    int length = sqlite3_column_bytes(lookup_statement_, 0);
+	    if (rows.empty() || docid.compare(0, docid.npos, blob, length) != 0) {
+		docid.assign(blob, length);
+		document = DocumentTable::instance().intern(docid);
+	    }
+	    rows.push_back(std::make_pair(document,
+					  uint32_t(sqlite3_column_int64(lookup_statement_, 1))));
+	}
+	check(rc);
+    }
+    std::sort(rows.begin(), rows.end());
 
-    // std::ostringstream ost;
-    // ost.fill('0');
-    // ost.width(2);
-    // ost << std::hex;
-    // for (auto p = md; p < md + SHA_DIGEST_LENGTH; p ++) {
-    // 	ost << (int)*p;
-    // }
+    std::shared_ptr<PostingList> list(new PostingList);
+    for (auto &row : rows)
+	list->add(row.first, row.second);
+    return list;
+}
 
-    // return ost.str();
+// Asked for few enough documents, positions are read per document
+// instead of for the whole bigram.
+std::vector<std::shared_ptr<const PostingList>>
+SQLiteDriver::postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+			     const std::vector<uint32_t> *documents) const
+{
+    const size_t MAX_DOCUMENT_QUERIES = 256;
+    if (!documents || documents->size() > MAX_DOCUMENT_QUERIES)
+	return Driver::postings_batch(bigrams, documents);
+
+    Metrics::Timer timer(Metrics::SQLITE_READ_LATENCY);
+    std::vector<std::string> docids;
+    for (auto document : *documents)
+	docids.push_back(DocumentTable::instance().digest(document));
+
+    std::vector<std::shared_ptr<const PostingList>> dest;
+    for (auto &bg : bigrams) {
+	std::shared_ptr<PostingList> list(new PostingList);
+	for (size_t i = 0; i < documents->size(); i ++) {
+	    StatementScope scope(document_postings_statement_);
+	    check(sqlite3_bind_int(document_postings_statement_, 1, bg.first));
+	    check(sqlite3_bind_int(document_postings_statement_, 2, bg.second));
+	    check(sqlite3_bind_blob(document_postings_statement_, 3, docids[i].data(),
+				    docids[i].length(), SQLITE_STATIC));
+	    int rc;
+	    while ((rc = sqlite3_step(document_postings_statement_)) == SQLITE_ROW)
+		list->add((*documents)[i],
+			  uint32_t(sqlite3_column_int64(document_postings_statement_, 0)));
+	    check(rc);
+	}
+	dest.push_back(list);
+    }
+    return dest;
+}
+
+// Every docid read is interned for good, so a bigram found in more
+// documents than are worth pruning with gives up: the whole lists are
+// read instead, as for drivers without document sets.
+bool SQLiteDriver::documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+				   std::vector<std::vector<uint32_t>> &documents) const
+{
+    const size_t MAX_DOCUMENTS = 4096;
+    Metrics::Timer timer(Metrics::SQLITE_READ_LATENCY);
+    std::vector<std::vector<std::string>> docids(bigrams.size());
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	StatementScope scope(documents_statement_);
+	check(sqlite3_bind_int(documents_statement_, 1, bigrams[i].first));
+	check(sqlite3_bind_int(documents_statement_, 2, bigrams[i].second));
+	int rc;
+	while ((rc = sqlite3_step(documents_statement_)) == SQLITE_ROW) {
+	    if (docids[i].size() == MAX_DOCUMENTS)
+		return false;
+	    docids[i].push_back(std::string((const char*)sqlite3_column_blob(documents_statement_, 0),
+					    sqlite3_column_bytes(documents_statement_, 0)));
+	}
+	check(rc);
+    }
+
+    documents.assign(bigrams.size(), std::vector<uint32_t>());
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	for (auto &docid : docids[i])
+	    documents[i].push_back(DocumentTable::instance().intern(docid));
+	std::sort(documents[i].begin(), documents[i].end());
+    }
+    return true;
+}
+
+void SQLiteDriver::register_path(const Path &path, const std::string &digest,
+				 const FileInfo &info)
+{
+    const std::string &p = path;
+
+    StatementScope scope(register_statement_);
+    check(sqlite3_bind_text(register_statement_, 1, p.data(), p.length(), SQLITE_STATIC));
+    check(sqlite3_bind_blob(register_statement_, 2, digest.data(), digest.length(),
+			    SQLITE_STATIC));
+    check(sqlite3_bind_int64(register_statement_, 3, info.size));
+    check(sqlite3_bind_int64(register_statement_, 4, info.mtime));
+    check(sqlite3_bind_int64(register_statement_, 5, info.inode));
+    check(sqlite3_step(register_statement_));
+}
+
+bool SQLiteDriver::lookup_path(const Path &path, std::string &digest, FileInfo &info)
+{
+    Metrics::Timer timer(Metrics::SQLITE_READ_LATENCY);
+    const std::string &p = path;
+
+    StatementScope scope(lookup_path_statement_);
+    check(sqlite3_bind_text(lookup_path_statement_, 1, p.data(), p.length(), SQLITE_STATIC));
+    int rc = sqlite3_step(lookup_path_statement_);
+    check(rc);
+    if (rc != SQLITE_ROW)
+	return false;
+
+    digest.assign((const char*)sqlite3_column_blob(lookup_path_statement_, 0),
+		  sqlite3_column_bytes(lookup_path_statement_, 0));
+    info.size = sqlite3_column_int64(lookup_path_statement_, 1);
+    info.mtime = sqlite3_column_int64(lookup_path_statement_, 2);
+    info.inode = sqlite3_column_int64(lookup_path_statement_, 3);
+    return true;
+}
+
+void SQLiteDriver::unregister_path(const Path &path)
+{
+    const std::string &p = path;
+
+    StatementScope scope(unregister_statement_);
+    check(sqlite3_bind_text(unregister_statement_, 1, p.data(), p.length(), SQLITE_STATIC));
+    check(sqlite3_step(unregister_statement_));
+}
+
+void SQLiteDriver::remove_document(const std::string &digest)
+{
+    {
+	StatementScope scope(remove_document_statement_);
+	check(sqlite3_bind_blob(remove_document_statement_, 1, digest.data(), digest.length(),
+				SQLITE_STATIC));
+	check(sqlite3_step(remove_document_statement_));
+    }
+    StatementScope scope(remove_bigram_documents_statement_);
+    check(sqlite3_bind_blob(remove_bigram_documents_statement_, 1, digest.data(),
+			    digest.length(), SQLITE_STATIC));
+    check(sqlite3_step(remove_bigram_documents_statement_));
+    if (last_docid_ == digest)
+	last_bigrams_.clear();
+}
+
+std::set<Path> SQLiteDriver::lookup_digest(const std::string &digest)
+{
+    Metrics::Timer timer(Metrics::SQLITE_READ_LATENCY);
+    std::set<Path> dest;
+
+    StatementScope scope(lookup_digest_statement_);
+    check(sqlite3_bind_blob(lookup_digest_statement_, 1, digest.data(), digest.length(),
+			    SQLITE_STATIC));
+    int rc;
+    while ((rc = sqlite3_step(lookup_digest_statement_)) == SQLITE_ROW) {
+	const char *path = (const char*)sqlite3_column_text(lookup_digest_statement_, 0);
+	dest.insert(Path(std::string(path, sqlite3_column_bytes(lookup_digest_statement_, 0))));
+    }
+    check(rc);
+
+    return dest;
+}
+
+CachingDriver::CachingDriver(std::shared_ptr<Driver> driver, size_t capacity)
+    : driver_(driver), capacity_(capacity), batch_depth_(0),
+      size_(0), generation_(0), hits_(0), misses_(0)
+{
+}
+
+uint64_t CachingDriver::key(int char1, int char2)
+{
+    return (uint64_t(uint32_t(char1)) << 32) | uint32_t(char2);
+}
+
+// Roughly what a list keeps alive: its directory, its bytes and the
+// bookkeeping of the cache entry.
+size_t CachingDriver::cost(const PostingList &list)
+{
+    return sizeof(PostingList) + sizeof(Entry) + 4 * sizeof(void*)
+	+ list.document_count() * sizeof(PostingList::Document) + list.byte_count();
+}
+
+bool CachingDriver::find(uint64_t key, std::shared_ptr<const PostingList> &list,
+			 bool count) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+	misses_ += count;
+	return false;
+    }
+    hits_ += count;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    list = it->second->list;
+    return true;
+}
+
+// Read before fetching from the driver and handed to insert(), which
+// drops the list if a write has finished in between.
+uint64_t CachingDriver::generation() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return generation_;
+}
+
+void CachingDriver::insert(uint64_t key, const std::shared_ptr<const PostingList> &list,
+			   uint64_t generation) const
+{
+    size_t c = cost(*list);
+    if (c > capacity_)
+	return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation != generation_ || index_.count(key))
+	return;
+    entries_.push_front(Entry(key, list, c));
+    index_[key] = entries_.begin();
+    size_ += c;
+    while (size_ > capacity_) {
+	auto &victim = entries_.back();
+	size_ -= victim.cost;
+	index_.erase(victim.key);
+	entries_.pop_back();
+    }
+}
+
+// Called once the driver has been written to, so that no fetch that
+// started before the write can still insert what it read.
+void CachingDriver::erase(uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_ ++;
+    auto it = index_.find(key);
+    if (it == index_.end())
+	return;
+    size_ -= it->second->cost;
+    entries_.erase(it->second);
+    index_.erase(it);
+}
+
+void CachingDriver::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_ ++;
+    entries_.clear();
+    index_.clear();
+    size_ = 0;
+}
+
+size_t CachingDriver::hits() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+size_t CachingDriver::misses() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+size_t CachingDriver::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+void CachingDriver::add(const Record &rec)
+{
+    driver_->add(rec);
+    erase(key(rec.first(), rec.second()));
+    if (batch_depth_ > 0)
+	batch_keys_.insert(key(rec.first(), rec.second()));
+}
+
+std::shared_ptr<const PostingList> CachingDriver::postings(int char1, int char2) const
+{
+    std::shared_ptr<const PostingList> list;
+    if (!find(key(char1, char2), list)) {
+	uint64_t before = generation();
+	list = driver_->postings(char1, char2);
+	insert(key(char1, char2), list, before);
+    }
+    return list;
+}
+
+// Only the misses go to the wrapped driver, still in a single batch.
+// They are fetched whole whatever documents are asked for, so that the
+// cache only ever holds complete lists.
+std::vector<std::shared_ptr<const PostingList>>
+CachingDriver::postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+			      const std::vector<uint32_t>*) const
+{
+    std::vector<std::shared_ptr<const PostingList>> dest(bigrams.size());
+    std::vector<std::pair<int, int>> missing;
+    std::vector<size_t> slots;
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	if (!find(key(bigrams[i].first, bigrams[i].second), dest[i])) {
+	    missing.push_back(bigrams[i]);
+	    slots.push_back(i);
+	}
+    }
+    if (missing.empty())
+	return dest;
+
+    uint64_t before = generation();
+    auto fetched = driver_->postings_batch(missing);
+    for (size_t i = 0; i < missing.size(); i ++) {
+	dest[slots[i]] = fetched[i];
+	insert(key(missing[i].first, missing[i].second), fetched[i], before);
+    }
+    return dest;
+}
+
+// Cached lists answer from their directories, the rest is asked for.
+// Only the postings fetched afterwards count as hits or misses.
+bool CachingDriver::documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+				    std::vector<std::vector<uint32_t>> &documents) const
+{
+    documents.assign(bigrams.size(), std::vector<uint32_t>());
+    std::vector<std::pair<int, int>> missing;
+    std::vector<size_t> slots;
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	std::shared_ptr<const PostingList> list;
+	if (find(key(bigrams[i].first, bigrams[i].second), list, false)) {
+	    auto doc = list->document_data();
+	    for (size_t j = 0; j < list->document_count(); j ++)
+		documents[i].push_back(doc[j].document);
+	} else {
+	    missing.push_back(bigrams[i]);
+	    slots.push_back(i);
+	}
+    }
+    if (missing.empty())
+	return true;
+
+    std::vector<std::vector<uint32_t>> fetched;
+    if (!driver_->documents_batch(missing, fetched))
+	return false;
+    for (size_t i = 0; i < missing.size(); i ++)
+	documents[slots[i]].swap(fetched[i]);
+    return true;
+}
+
+void CachingDriver::register_path(const Path &path, const std::string &digest,
+				  const FileInfo &info)
+{
+    driver_->register_path(path, digest, info);
+}
+
+std::set<Path> CachingDriver::lookup_digest(const std::string &digest)
+{
+    return driver_->lookup_digest(digest);
+}
+
+bool CachingDriver::lookup_path(const Path &path, std::string &digest, FileInfo &info)
+{
+    return driver_->lookup_path(path, digest, info);
+}
+
+void CachingDriver::unregister_path(const Path &path)
+{
+    driver_->unregister_path(path);
+}
+
+void CachingDriver::remove_document(const std::string &digest)
+{
+    driver_->remove_document(digest);
+    clear();
+}
+
+void CachingDriver::begin_batch()
+{
+    driver_->begin_batch();
+    batch_depth_ ++;
+}
+
+// A list read between an add and the commit may predate the add where
+// the driver only shows it now.
+void CachingDriver::commit_batch()
+{
+    driver_->commit_batch();
+    if (--batch_depth_ > 0)
+	return;
+    std::set<uint64_t> keys;
+    keys.swap(batch_keys_);
+    for (auto k : keys)
+	erase(k);
+}
+
+// Lists read inside the batch may hold postings that were rolled back.
+void CachingDriver::rollback_batch()
+{
+    driver_->rollback_batch();
+    if (--batch_depth_ == 0)
+	batch_keys_.clear();
+    clear();
+}
+
+void CachingDriver::merge(const MemoryDriver &segment)
+{
+    driver_->merge(segment);
+    segment.for_each([this](int char1, int char2, const PostingList&) {
+	    erase(key(char1, char2));
+	    if (batch_depth_ > 0)
+		batch_keys_.insert(key(char1, char2));
+	});
+}
+
+namespace {
+    // commands queued before the pipeline is sent while a batch is open
+    const size_t REDIS_PIPELINE = 8192;
+
+    std::string hex(const std::string &data)
+    {
+	static const char digits[] = "0123456789abcdef";
+	std::string dest;
+	dest.reserve(data.length() * 2);
+	for (unsigned char c : data) {
+	    dest += digits[c >> 4];
+	    dest += digits[c & 15];
+	}
+	return dest;
+    }
+
+    // A bigram as the UTF-8 text of its two characters.
+    std::string bigram_text(int char1, int char2)
+    {
+	std::string dest;
+	utf8::append(char1, std::back_inserter(dest));
+	utf8::append(char2, std::back_inserter(dest));
+	return dest;
+    }
+
+    std::string index_key(const std::string &hexdigest, const std::string &bigram)
+    {
+	return "2g:index:" + hexdigest + ":" + bigram;
+    }
+
+    std::string to_string(int64_t value)
+    {
+	std::ostringstream oss;
+	oss << value;
+	return oss.str();
+    }
+}
+
+void RedisDriver::split_address(const std::string &address, std::string &host,
+				unsigned short &port)
+{
+    size_t colon = address.rfind(':');
+    host = address.substr(0, colon);
+    port = colon == address.npos ? 6379 : atoi(address.c_str() + colon + 1);
+}
+
+RedisDriver::RedisDriver(const std::string &host, unsigned short port)
+    : socket_(-1), in_pos_(0), pending_(0), last_document_(uint32_t(-1))
+{
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addrs);
+    if (rc != 0)
+	throw std::string("RedisDriver: ") + host + ": " + gai_strerror(rc);
+
+    for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+	socket_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (socket_ < 0)
+	    continue;
+	if (connect(socket_, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	close(socket_);
+	socket_ = -1;
+    }
+    freeaddrinfo(addrs);
+    if (socket_ < 0)
+	throw std::string("RedisDriver: cannot connect to ") + host + ": " + strerror(errno);
+
+    int one = 1;
+    setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#if defined(SO_NOSIGPIPE)
+    setsockopt(socket_, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+RedisDriver::~RedisDriver()
+{
+    try {
+	flush();
+    } catch (...) {
+    }
+    if (socket_ >= 0)
+	close(socket_);
+}
+
+std::string RedisDriver::encode(const std::vector<std::string> &args)
+{
+    std::string dest = "*" + to_string(args.size()) + "\r\n";
+    for (auto &arg : args) {
+	dest += "$" + to_string(arg.length()) + "\r\n";
+	dest += arg;
+	dest += "\r\n";
+    }
+    return dest;
+}
+
+// Queues a command; its reply is read by the next flush().
+void RedisDriver::command(const std::vector<std::string> &args) const
+{
+    out_ += encode(args);
+    pending_ ++;
+}
+
+// Sends every queued command and reads all their replies. The first
+// error reply is thrown once the connection is back in step.
+std::vector<RedisDriver::Reply> RedisDriver::flush() const
+{
+    noted_.clear();
+    std::string out;
+    std::swap(out, out_);
+    send(out);
+
+    std::vector<Reply> replies;
+    replies.reserve(pending_);
+    for (; pending_ > 0; pending_ --)
+	replies.push_back(receive());
+    for (auto &reply : replies) {
+	if (reply.type == '-')
+	    throw std::string("RedisDriver: ") + reply.str;
+    }
+    return replies;
+}
+
+// A command that needs its reply, sent with everything queued before it.
+RedisDriver::Reply RedisDriver::call(const std::vector<std::string> &args) const
+{
+    command(args);
+    return flush().back();
+}
+
+// A read that does not depend on the queued commands, sent ahead of them.
+// The replies of everything sent before have all been read, so its reply
+// is the next to arrive.
+RedisDriver::Reply RedisDriver::query(const std::vector<std::string> &args) const
+{
+    send(encode(args));
+    Reply reply = receive();
+    if (reply.type == '-')
+	throw std::string("RedisDriver: ") + reply.str;
+    return reply;
+}
+
+void RedisDriver::send(const std::string &data) const
+{
+    if (socket_ < 0)
+	throw std::string("RedisDriver: connection lost");
+#if defined(MSG_NOSIGNAL)
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    size_t sent = 0;
+    while (sent < data.length()) {
+	ssize_t n = ::send(socket_, data.data() + sent, data.length() - sent, flags);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {
+	    std::string err = strerror(errno);
+	    disconnect();
+	    throw "RedisDriver: " + err;
+	}
+	sent += n;
+    }
+}
+
+// Reads the next reply. After a failure the stream is at an unknown
+// point, so the connection is dropped rather than misread later.
+RedisDriver::Reply RedisDriver::receive() const
+{
+    try {
+	return read_reply();
+    } catch (...) {
+	disconnect();
+	throw;
+    }
+}
+
+void RedisDriver::disconnect() const
+{
+    if (socket_ >= 0)
+	close(socket_);
+    socket_ = -1;
+    out_.clear();
+    in_.clear();
+    in_pos_ = 0;
+    pending_ = 0;
+    noted_.clear();
+}
+
+void RedisDriver::fill() const
+{
+    if (in_pos_ > 0) {
+	in_.erase(0, in_pos_);
+	in_pos_ = 0;
+    }
+    char buffer[65536];
+    ssize_t n;
+    while ((n = recv(socket_, buffer, sizeof(buffer), 0)) < 0 && errno == EINTR)
+	;
+    if (n < 0)
+	throw std::string("RedisDriver: ") + strerror(errno);
+    if (n == 0)
+	throw std::string("RedisDriver: connection closed");
+    in_.append(buffer, n);
+}
+
+std::string RedisDriver::read_line() const
+{
+    size_t end;
+    while ((end = in_.find("\r\n", in_pos_)) == in_.npos)
+	fill();
+    std::string line = in_.substr(in_pos_, end - in_pos_);
+    in_pos_ = end + 2;
+    return line;
+}
+
+RedisDriver::Reply RedisDriver::read_reply() const
+{
+    Reply reply;
+    std::string line = read_line();
+    if (line.empty())
+	throw std::string("RedisDriver: malformed reply");
+    reply.type = line[0];
+
+    switch (reply.type) {
+    case '+':
+    case '-':
+	reply.str = line.substr(1);
+	break;
+    case ':':
+	reply.integer = strtoll(line.c_str() + 1, nullptr, 10);
+	break;
+    case '$': {
+	long length = strtol(line.c_str() + 1, nullptr, 10);
+	if (length < 0) {
+	    reply.nil = true;
+	    break;
+	}
+	while (in_.length() - in_pos_ < size_t(length) + 2)
+	    fill();
+	reply.str = in_.substr(in_pos_, length);
+	in_pos_ += length + 2;
+	break;
+    }
+    case '*': {
+	long count = strtol(line.c_str() + 1, nullptr, 10);
+	if (count < 0) {
+	    reply.nil = true;
+	    break;
+	}
+	for (long i = 0; i < count; i ++) {
+	    Reply element = read_reply();
+	    if (element.type != '$' && element.type != '+' && element.type != ':')
+		throw std::string("RedisDriver: unexpected nested reply");
+	    reply.elements.push_back(element.type == ':' ? to_string(element.integer)
+				     : element.str);
+	}
+	break;
+    }
+    default:
+	throw std::string("RedisDriver: malformed reply");
+    }
+    return reply;
+}
+
+void RedisDriver::begin_batch()
+{
+    batches_.push_back(Batch());
+}
+
+void RedisDriver::commit_batch()
+{
+    Batch batch;
+    std::swap(batch, batches_.back());
+    batches_.pop_back();
+    if (batches_.empty()) {
+	apply_paths(batch.paths);
+	return;
+    }
+
+    // the enclosing batch answers for this one's work from now on
+    Batch &outer = batches_.back();
+    outer.documents.insert(batch.documents.cbegin(), batch.documents.cend());
+    outer.last_document = uint32_t(-1);
+    for (auto &change : batch.paths)
+	outer.paths[change.first] = change.second;
+}
+
+void RedisDriver::rollback_batch()
+{
+    Batch batch;
+    std::swap(batch, batches_.back());
+    batches_.pop_back();
+    if (!batches_.empty())
+	batches_.back().last_document = uint32_t(-1);
+
+    // part of the postings may be on the server already
+    for (auto &hexdigest : batch.documents)
+	remove_postings(hexdigest);
+    if (batches_.empty())
+	flush();
+}
+
+void RedisDriver::add(const Record &rec)
+{
+    // records come in runs per document; the digest is looked up once a run
+    uint32_t document = rec.position().document();
+    if (document != last_document_) {
+	last_hexdigest_ = hex(rec.position().docid());
+	last_document_ = document;
+    }
+    if (!batches_.empty() && batches_.back().last_document != document) {
+	batches_.back().documents.insert(last_hexdigest_);
+	batches_.back().last_document = document;
+    }
+
+    const std::string &hexdigest = last_hexdigest_;
+    std::string bigram = bigram_text(rec.first(), rec.second());
+    std::string key = index_key(hexdigest, bigram);
+    std::string position = to_string(rec.position().position());
+
+    command({"ZADD", key, position, position});
+    if (noted_.insert(key).second) {
+	command({"SADD", "2g:bigram:" + bigram, hexdigest});
+	command({"SADD", "2g:doc:" + hexdigest, bigram});
+    }
+    if (batches_.empty() || pending_ >= REDIS_PIPELINE)
+	flush();
+}
+
+std::shared_ptr<const PostingList> RedisDriver::postings(int char1, int char2) const
+{
+    return postings_batch(std::vector<std::pair<int, int>>(1, std::make_pair(char1, char2)))
+	.front();
+}
+
+// The documents of each bigram as (ordinal, hex digest), ascending.
+std::vector<std::vector<std::pair<uint32_t, std::string>>>
+RedisDriver::bigram_documents(const std::vector<std::string> &texts) const
+{
+    flush();
+    for (auto &text : texts)
+	command({"SMEMBERS", "2g:bigram:" + text});
+    auto replies = flush();
+
+    std::vector<std::vector<std::pair<uint32_t, std::string>>> dest(texts.size());
+    for (size_t i = 0; i < texts.size(); i ++) {
+	for (auto &hexdigest : replies[i].elements) {
+	    std::string digest;
+	    for (size_t j = 0; j + 1 < hexdigest.length(); j += 2)
+		digest += char(strtol(hexdigest.substr(j, 2).c_str(), nullptr, 16));
+	    dest[i].push_back(std::make_pair(DocumentTable::instance().intern(digest),
+					     hexdigest));
+	}
+	// sets are unordered, and digest order is not ordinal order anyway
+	std::sort(dest[i].begin(), dest[i].end());
+    }
+    return dest;
+}
+
+// Two round trips for any number of bigrams: one for the documents of
+// every bigram, one for the positions of every (document, bigram). Given
+// the documents, the first one is skipped.
+std::vector<std::shared_ptr<const PostingList>>
+RedisDriver::postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+			    const std::vector<uint32_t> *documents) const
+{
+    std::vector<std::string> texts;
+    for (auto &bg : bigrams)
+	texts.push_back(bigram_text(bg.first, bg.second));
+
+    std::vector<std::vector<std::pair<uint32_t, std::string>>> rows;
+    if (documents) {
+	std::vector<std::pair<uint32_t, std::string>> given;
+	for (auto document : *documents)
+	    given.push_back(std::make_pair(document,
+					   hex(DocumentTable::instance().digest(document))));
+	rows.assign(bigrams.size(), given);
+	flush();
+    } else {
+	rows = bigram_documents(texts);
+    }
+
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	for (auto &row : rows[i])
+	    command({"ZRANGE", index_key(row.second, texts[i]), "0", "-1"});
+    }
+    auto positions = flush();
+
+    std::vector<std::shared_ptr<const PostingList>> dest;
+    auto reply = positions.cbegin();
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	std::shared_ptr<PostingList> list(new PostingList);
+	for (auto &row : rows[i]) {
+	    for (auto &position : reply->elements)
+		list->add(row.first, uint32_t(strtoul(position.c_str(), nullptr, 10)));
+	    ++ reply;
+	}
+	dest.push_back(list);
+    }
+    return dest;
+}
+
+bool RedisDriver::documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+				  std::vector<std::vector<uint32_t>> &documents) const
+{
+    std::vector<std::string> texts;
+    for (auto &bg : bigrams)
+	texts.push_back(bigram_text(bg.first, bg.second));
+    auto rows = bigram_documents(texts);
+
+    documents.assign(bigrams.size(), std::vector<uint32_t>());
+    for (size_t i = 0; i < bigrams.size(); i ++) {
+	for (auto &row : rows[i])
+	    documents[i].push_back(row.first);
+    }
+    return true;
+}
+
+void RedisDriver::register_path(const Path &path, const std::string &digest,
+				const FileInfo &info)
+{
+    PathChange change = {true, digest, info};
+    change_path(path, change);
+}
+
+void RedisDriver::change_path(const std::string &path, const PathChange &change)
+{
+    if (!batches_.empty()) {
+	batches_.back().paths[path] = change;
+	return;
+    }
+    std::map<std::string, PathChange> paths;
+    paths[path] = change;
+    apply_paths(paths);
+}
+
+// Sends the queued commands and the path changes, in two round trips
+// however many paths there are: one to learn the digests the paths had,
+// one to move them.
+void RedisDriver::apply_paths(const std::map<std::string, PathChange> &paths)
+{
+    for (auto &change : paths)
+	command({"HGET", "2g:file:" + change.first, "digest"});
+    auto replies = flush();
+    if (paths.empty())
+	return;
+
+    auto previous = replies.cend() - paths.size();
+    for (auto &change : paths) {
+	const std::string &p = change.first;
+	const PathChange &to = change.second;
+	if (!previous->nil && (!to.registered || previous->str != to.digest))
+	    command({"SREM", "2g:path:" + hex(previous->str), p});
+	if (to.registered) {
+	    command({"SADD", "2g:path:" + hex(to.digest), p});
+	    command({"HMSET", "2g:file:" + p, "digest", to.digest,
+		     "size", to_string(to.info.size), "mtime", to_string(to.info.mtime),
+		     "inode", to_string(to.info.inode)});
+	} else if (!previous->nil) {
+	    command({"DEL", "2g:file:" + p});
+	}
+	++ previous;
+    }
+    flush();
+}
+
+std::set<Path> RedisDriver::lookup_digest(const std::string &digest)
+{
+    std::set<Path> dest;
+    for (auto &path : query({"SMEMBERS", "2g:path:" + hex(digest)}).elements)
+	dest.insert(Path(path));
+
+    // changes of open batches, the innermost last
+    std::map<std::string, const PathChange*> changes;
+    for (auto &batch : batches_) {
+	for (auto &change : batch.paths)
+	    changes[change.first] = &change.second;
+    }
+    for (auto &change : changes) {
+	if (change.second->registered && change.second->digest == digest)
+	    dest.insert(Path(change.first));
+	else
+	    dest.erase(Path(change.first));
+    }
+    return dest;
+}
+
+bool RedisDriver::lookup_path(const Path &path, std::string &digest, FileInfo &info)
+{
+    const std::string &p = path;
+
+    for (auto batch = batches_.crbegin(); batch != batches_.crend(); batch ++) {
+	auto change = batch->paths.find(p);
+	if (change == batch->paths.end())
+	    continue;
+	if (!change->second.registered)
+	    return false;
+	digest = change->second.digest;
+	info = change->second.info;
+	return true;
+    }
+
+    Reply fields = query({"HGETALL", "2g:file:" + p});
+    if (fields.elements.empty())
+	return false;
+    for (size_t i = 0; i + 1 < fields.elements.size(); i += 2) {
+	const std::string &name = fields.elements[i];
+	const std::string &value = fields.elements[i + 1];
+	if (name == "digest")
+	    digest = value;
+	else if (name == "size")
+	    info.size = strtoull(value.c_str(), nullptr, 10);
+	else if (name == "mtime")
+	    info.mtime = strtoll(value.c_str(), nullptr, 10);
+	else if (name == "inode")
+	    info.inode = strtoull(value.c_str(), nullptr, 10);
+    }
+    return true;
+}
+
+void RedisDriver::unregister_path(const Path &path)
+{
+    PathChange change = {false, std::string(), FileInfo()};
+    change_path(path, change);
+}
+
+void RedisDriver::remove_document(const std::string &digest)
+{
+    remove_postings(hex(digest));
+}
+
+void RedisDriver::remove_postings(const std::string &hexdigest)
+{
+    // the document's bigrams may still be queued
+    for (auto &bigram : call({"SMEMBERS", "2g:doc:" + hexdigest}).elements) {
+	command({"DEL", index_key(hexdigest, bigram)});
+	command({"SREM", "2g:bigram:" + bigram, hexdigest});
+    }
+    command({"DEL", "2g:doc:" + hexdigest});
+    if (batches_.empty() || pending_ >= REDIS_PIPELINE)
+	flush();
+}
+
+namespace {
+    // Index file layout, all integers in host byte order:
+    //
+    //   IndexHeader
+    //   IndexBigram[bigram_count]			sorted by key
+    //   per bigram: PostingList::Document[], encoded positions
+    //   IndexString[document_count]			digest of each document id
+    //   IndexPath[path_count]				sorted by document id
+    //   string pool
+    //
+    // Document ids are dense and follow the ordinals of the writing
+    // process, so directories stay sorted when they are mapped back.
+    const char index_magic[8] = {'2', 'G', 'I', 'D', 'X', 0, 0, 1};
+    const uint32_t index_byte_order = 0x01020304;
+
+    struct IndexHeader {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t reserved;
+	uint64_t file_size;
+	uint64_t bigram_count, bigram_offset;
+	uint64_t document_count, document_offset;
+	uint64_t path_count, path_offset;
+    };
+
+    struct IndexBigram {
+	uint64_t key;
+	uint64_t documents_offset;
+	uint64_t bytes_offset;
+	uint32_t document_count;
+	uint32_t byte_count;
+	uint64_t size;
+    };
+
+    struct IndexString {
+	uint64_t offset;
+	uint64_t length;
+    };
+
+    struct IndexPath {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t document;
+    };
+
+    class IndexWriter {
+    public:
+	IndexWriter(const std::string &filename)
+	    : os_(filename, std::ios::binary | std::ios::trunc), offset_(0) {
+	    if (!os_)
+		throw std::string("cannot create index file: ") + filename;
+	}
+	uint64_t write(const void *data, size_t length) {
+	    uint64_t offset = offset_;
+	    os_.write((const char*)data, length);
+	    offset_ += length;
+	    return offset;
+	}
+	template <typename T> uint64_t write(const std::vector<T> &items) {
+	    return write(items.data(), items.size() * sizeof(T));
+	}
+	void align() {
+	    static const char zeros[8] = {0};
+	    write(zeros, (8 - offset_ % 8) % 8);
+	}
+	uint64_t offset() const {return offset_;}
+	void rewrite(uint64_t offset, const void *data, size_t length) {
+	    os_.seekp(offset);
+	    os_.write((const char*)data, length);
+	    os_.seekp(offset_);
+	}
+	void close() {
+	    os_.close();
+	    if (!os_)
+		throw std::string("cannot write index file");
+	}
+    private:
+	std::ofstream os_;
+	uint64_t offset_;
+    };
+
+    // A directory rewritten to this process's ordinals, shared by the
+    // lists viewing it together with the mapping they point into.
+    struct RemappedDirectory {
+	std::shared_ptr<const void> mapping;
+	std::vector<PostingList::Document> documents;
+    };
+}
+
+void MmapDriver::write(const std::string &filename, const MemoryDriver &source)
+{
+    std::vector<std::pair<uint64_t, const PostingList*>> lists;
+    std::set<uint32_t> ordinals;
+    source.for_each([&](int char1, int char2, const PostingList &list) {
+	    uint64_t key = (uint64_t(uint32_t(char1)) << 32) | uint32_t(char2);
+	    lists.push_back(std::make_pair(key, &list));
+	    for (size_t i = 0; i < list.document_count(); i ++)
+		ordinals.insert(list.document_data()[i].document);
+	});
+    std::vector<std::pair<uint32_t, std::string>> paths;
+    source.for_each_path([&](const Path &path, const std::string &digest, const FileInfo&) {
+	    uint32_t document = DocumentTable::instance().intern(digest);
+	    ordinals.insert(document);
+	    paths.push_back(std::make_pair(document, std::string(path)));
+	});
+    std::sort(lists.begin(), lists.end());
+
+    std::unordered_map<uint32_t, uint32_t> local;
+    std::vector<uint32_t> documents(ordinals.cbegin(), ordinals.cend());
+    for (uint32_t i = 0; i < documents.size(); i ++)
+	local[documents[i]] = i;
+    for (auto &path : paths)
+	path.first = local[path.first];
+    std::sort(paths.begin(), paths.end());
+
+    IndexWriter out(filename);
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    out.write(&header, sizeof(header));
+
+    std::vector<IndexBigram> bigrams(lists.size());
+    header.bigram_count = bigrams.size();
+    header.bigram_offset = out.write(bigrams);
+    for (size_t i = 0; i < lists.size(); i ++) {
+	const PostingList &list = *lists[i].second;
+	std::vector<PostingList::Document> directory(list.document_data(),
+						     list.document_data() + list.document_count());
+	for (auto &doc : directory)
+	    doc.document = local[doc.document];
+
+	IndexBigram &bigram = bigrams[i];
+	bigram.key = lists[i].first;
+	bigram.document_count = directory.size();
+	bigram.byte_count = list.byte_count();
+	bigram.size = list.size();
+	out.align();
+	bigram.documents_offset = out.write(directory);
+	bigram.bytes_offset = out.write(list.byte_data(), list.byte_count());
+    }
+    out.rewrite(header.bigram_offset, bigrams.data(), bigrams.size() * sizeof(IndexBigram));
+
+    // strings follow the tables that refer to them, so offsets are known
+    // once the table sizes are
+    out.align();
+    uint64_t pool = out.offset() + documents.size() * sizeof(IndexString)
+	+ paths.size() * sizeof(IndexPath);
+    std::vector<std::string> digests;
+    std::vector<IndexString> strings;
+    for (auto document : documents) {
+	digests.push_back(DocumentTable::instance().digest(document));
+	IndexString str = {pool, digests.back().length()};
+	strings.push_back(str);
+	pool += str.length;
+    }
+    std::vector<IndexPath> entries;
+    for (auto &path : paths) {
+	IndexPath entry = {pool, uint32_t(path.second.length()), path.first};
+	entries.push_back(entry);
+	pool += entry.length;
+    }
+    header.document_count = strings.size();
+    header.document_offset = out.write(strings);
+    header.path_count = entries.size();
+    header.path_offset = out.write(entries);
+    for (auto &digest : digests)
+	out.write(digest.data(), digest.length());
+    for (auto &path : paths)
+	out.write(path.second.data(), path.second.length());
+
+    memcpy(header.magic, index_magic, sizeof(header.magic));
+    header.byte_order = index_byte_order;
+    header.file_size = out.offset();
+    out.rewrite(0, &header, sizeof(header));
+    out.close();
+}
+
+MmapDriver::MmapDriver(const std::string &filename)
+    : data_(nullptr), size_(0), bigrams_(nullptr), bigram_count_(0),
+      paths_(nullptr), path_count_(0), identity_(true)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile(filename));
+    mapping_ = file;
+    data_ = (const uint8_t*)file->begin();
+    size_ = file->size();
+    if (size_ < sizeof(IndexHeader))
+	throw std::string("not an index file: ") + filename;
+
+    const IndexHeader &header = *at<IndexHeader>(0, 1);
+    if (memcmp(header.magic, index_magic, sizeof(header.magic)) != 0
+	|| header.byte_order != index_byte_order || header.file_size != size_)
+	throw std::string("not an index file: ") + filename;
+
+    bigrams_ = at<IndexBigram>(header.bigram_offset, header.bigram_count);
+    bigram_count_ = header.bigram_count;
+    paths_ = at<IndexPath>(header.path_offset, header.path_count);
+    path_count_ = header.path_count;
+
+    auto strings = at<IndexString>(header.document_offset, header.document_count);
+    for (uint32_t i = 0; i < header.document_count; i ++) {
+	const char *digest = at<char>(strings[i].offset, strings[i].length);
+	uint32_t document = DocumentTable::instance().intern(
+	    std::string(digest, strings[i].length));
+	documents_.push_back(document);
+	local_documents_[document] = i;
+	identity_ = identity_ && document == i;
+    }
+
+    // Every offset and count the directories hold is checked here, so a
+    // damaged file fails to open rather than reading past the mapping
+    // later. The position bytes themselves are only decoded on use.
+    auto bigrams = (const IndexBigram*)bigrams_;
+    auto paths = (const IndexPath*)paths_;
+    for (uint64_t i = 0; i < bigram_count_; i ++) {
+	const IndexBigram &bigram = bigrams[i];
+	if (i > 0 && bigrams[i - 1].key >= bigram.key)
+	    throw std::string("corrupt index file: bigrams out of order");
+	auto directory = at<PostingList::Document>(bigram.documents_offset,
+						   bigram.document_count);
+	at<uint8_t>(bigram.bytes_offset, bigram.byte_count);
+	uint64_t size = 0;
+	for (uint32_t j = 0; j < bigram.document_count; j ++) {
+	    const PostingList::Document &doc = directory[j];
+	    if (doc.document >= header.document_count || doc.offset > bigram.byte_count
+		|| (j > 0 && (directory[j - 1].document >= doc.document
+			      || directory[j - 1].offset > doc.offset)))
+		throw std::string("corrupt index file: bad posting directory");
+	    size += doc.count;
+	}
+	if (size != bigram.size)
+	    throw std::string("corrupt index file: bad posting count");
+    }
+    for (uint64_t i = 0; i < path_count_; i ++) {
+	const IndexPath &path = paths[i];
+	at<char>(path.offset, path.length);
+	if (path.document >= header.document_count
+	    || (i > 0 && paths[i - 1].document > path.document))
+	    throw std::string("corrupt index file: bad path table");
+    }
+}
+
+template <typename T>
+const T* MmapDriver::at(uint64_t offset, uint64_t count) const
+{
+    if (offset > size_ || count > (size_ - offset) / sizeof(T))
+	throw std::string("corrupt index file");
+    return (const T*)(data_ + offset);
+}
+
+void MmapDriver::add(const Record &)
+{
+    throw std::string("MmapDriver: index is read-only");
+}
+
+void MmapDriver::register_path(const Path &, const std::string &, const FileInfo &)
+{
+    throw std::string("MmapDriver: index is read-only");
+}
+
+// Index files do not keep file metadata, so paths never look up to date.
+bool MmapDriver::lookup_path(const Path &, std::string &, FileInfo &)
+{
+    return false;
+}
+
+void MmapDriver::unregister_path(const Path &)
+{
+    throw std::string("MmapDriver: index is read-only");
+}
+
+void MmapDriver::remove_document(const std::string &)
+{
+    throw std::string("MmapDriver: index is read-only");
+}
+
+std::shared_ptr<const PostingList> MmapDriver::postings(int char1, int char2) const
+{
+    static const std::shared_ptr<const PostingList> empty(new PostingList);
+
+    uint64_t key = (uint64_t(uint32_t(char1)) << 32) | uint32_t(char2);
+    auto begin = (const IndexBigram*)bigrams_;
+    auto end = begin + bigram_count_;
+    auto bigram = std::lower_bound(begin, end, key, [](const IndexBigram &b, uint64_t key) {
+	    return b.key < key;
+	});
+    if (bigram == end || bigram->key != key)
+	return empty;
+
+    auto directory = at<PostingList::Document>(bigram->documents_offset,
+					       bigram->document_count);
+    auto bytes = at<uint8_t>(bigram->bytes_offset, bigram->byte_count);
+    if (identity_) {
+	return PostingList::view(directory, bigram->document_count,
+				 bytes, bigram->byte_count, bigram->size, mapping_);
+    }
+
+    // Ordinals of this process differ from the file's document ids: only
+    // the directory is rewritten, the positions stay in the mapping.
+    std::shared_ptr<RemappedDirectory> remapped(new RemappedDirectory);
+    remapped->mapping = mapping_;
+    remapped->documents.assign(directory, directory + bigram->document_count);
+    for (auto &doc : remapped->documents)
+	doc.document = documents_.at(doc.document);
+    std::sort(remapped->documents.begin(), remapped->documents.end(),
+	      [](const PostingList::Document &a, const PostingList::Document &b) {
+		  return a.document < b.document;
+	      });
+    return PostingList::view(remapped->documents.data(), remapped->documents.size(),
+			     bytes, bigram->byte_count, bigram->size, remapped);
+}
+
+std::set<Path> MmapDriver::lookup_digest(const std::string &digest)
+{
+    std::set<Path> dest;
+
+    uint32_t document;
+    if (!DocumentTable::instance().find(digest, document))
+	return dest;
+    auto it = local_documents_.find(document);
+    if (it == local_documents_.end())
+	return dest;
+
+    auto begin = (const IndexPath*)paths_;
+    auto end = begin + path_count_;
+    IndexPath probe = {0, 0, it->second};
+    auto range = std::equal_range(begin, end, probe, [](const IndexPath &a, const IndexPath &b) {
+	    return a.document < b.document;
+	});
+    for (auto path = range.first; path != range.second; path ++)
+	dest.insert(Path(std::string(at<char>(path->offset, path->length), path->length)));
+    return dest;
+}
+
+bool Bigram::stat_file(const std::string &path, FileInfo &info)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+	return false;
+
+    info.size = st.st_size;
+#if defined(__APPLE__)
+    info.mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    info.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    info.inode = st.st_ino;
+    return true;
+}
+
+std::string Bigram::digest_file(const std::string &path)
+{
+    MappedFile file(path);
+    return digest_lines(file.begin(), file.end());
 }
@@ -3,19 +3,100 @@
 
 namespace Bigram
 {
+    // Maps document digests to dense ordinals so that postings carry a
+    // 32-bit integer instead of a copy of the digest.
+    class DocumentTable {
+    public:
+        static DocumentTable& instance();
+        uint32_t intern(const std::string &digest);
+        std::string digest(uint32_t document) const;
+	// Like intern(), but fails instead of adding an unknown digest.
+	bool find(const std::string &digest, uint32_t &document) const;
+    private:
+        DocumentTable() {}
+        DocumentTable(const DocumentTable&);
+
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, uint32_t> documents_;
+        std::vector<std::string> digests_;
+    };
+
+    // Process-wide counters and latency histograms. Each thread updates a
+    // slot of its own with relaxed atomics and callers add per batch, not
+    // per record, so keeping them costs next to nothing; snapshot() sums
+    // the slots.
+    class Metrics {
+    public:
+	enum Counter {
+	    LOOKUPS,		// posting lists asked of a driver
+	    POSTINGS_SCANNED,	// postings in the lists a search evaluated
+	    POSTINGS_RETURNED,	// positions a search returned
+	    RECORDS_INSERTED,
+	    BYTES_DISASSEMBLED,
+	    COUNTERS
+	};
+	enum Histogram {
+	    SEARCH_LATENCY,		// a single query
+	    SEARCH_BATCH_LATENCY,	// search_many() of several queries
+	    SQLITE_BATCH_LATENCY,	// BEGIN to COMMIT or ROLLBACK
+	    SQLITE_READ_LATENCY,	// a postings, document or path lookup
+	    HISTOGRAMS
+	};
+	// Bucket i counts durations under 2^i microseconds, the last one
+	// everything longer.
+	static const size_t BUCKETS = 32;
+
+	struct Snapshot {
+	    Snapshot();
+	    uint64_t count(Histogram histogram) const;
+	    // Text exposition format, for a /metrics endpoint.
+	    std::string prometheus() const;
+
+	    uint64_t counters[COUNTERS];
+	    uint64_t buckets[HISTOGRAMS][BUCKETS];
+	    uint64_t nanoseconds[HISTOGRAMS];
+	};
+
+	// Observes the time from construction to destruction.
+	class Timer {
+	public:
+	    Timer(Histogram histogram);
+	    ~Timer();
+	private:
+	    Timer(const Timer&);
+	    Histogram histogram_;
+	    uint64_t start_;
+	};
+
+	static Metrics& instance();
+	void add(Counter counter, uint64_t n = 1);
+	void observe(Histogram histogram, uint64_t nanoseconds);
+	Snapshot snapshot() const;
+	void reset();
+    private:
+	Metrics();
+	Metrics(const Metrics&);
+	struct Slot;
+
+	Slot *slots_;
+    };
+
     class Position {
     public:
         Position(const std::string &docid, unsigned int position)
-            : docid_(docid), position_(position) {}
+            : document_(DocumentTable::instance().intern(docid)), position_(position) {}
+        Position(uint32_t document, unsigned int position)
+            : document_(document), position_(position) {}
         Position(const Position &pos)
-            : docid_(pos.docid_), position_(pos.position_) {}
+            : document_(pos.document_), position_(pos.position_) {}
         bool operator==(const Position &pos) const;
         bool operator<(const Position &pos) const;
-        std::string docid() const {return docid_;}
+        std::string docid() const {return DocumentTable::instance().digest(document_);}
+        uint32_t document() const {return document_;}
         unsigned int position() const {return position_;}
     private:
         Position();
-        std::string docid_;
+        uint32_t document_;
         unsigned int position_;
     };
 
@@ -43,36 +124,609 @@ namespace Bigram
 	std::string path_;
     };
 
+    // Postings of a single bigram. Documents are kept in ascending order
+    // and the positions of each document are delta-encoded as varints in
+    // one byte stream, so a posting costs one or two bytes instead of a
+    // tree node.
+    class PostingList {
+    public:
+	struct Document {
+	    uint32_t document;
+	    uint32_t count;	// number of positions
+	    uint32_t offset;	// start of the positions in the byte stream
+	    uint32_t last;	// largest position, base of the next delta
+	};
+
+	// Decodes the postings in (document, position) order.
+	class Cursor {
+	public:
+	    Cursor(const PostingList &list);
+	    bool valid() const {return doc_ != end_;}
+	    uint32_t document() const {return doc_->document;}
+	    uint32_t position() const {return position_;}
+	    void next();
+	    // Moves forward to the first posting at or after (document,
+	    // position); returns false when the list is exhausted.
+	    bool seek(uint32_t document, uint32_t position);
+	private:
+	    Cursor();
+	    void enter();
+
+	    const Document *doc_;
+	    const Document *end_;
+	    const uint8_t *bytes_;
+	    const uint8_t *p_;
+	    uint32_t remaining_;
+	    uint32_t position_;
+	};
+
+	PostingList()
+	    : view_documents_(nullptr), view_document_count_(0),
+	      view_bytes_(nullptr), view_byte_count_(0), size_(0) {}
+	// A list over encoded data owned by someone else, e.g. a mapped
+	// index file; `owner` is kept alive as long as the list.
+	static std::shared_ptr<const PostingList>
+	view(const Document *documents, size_t document_count,
+	     const uint8_t *bytes, size_t byte_count, size_t size,
+	     std::shared_ptr<const void> owner);
+
+	void add(uint32_t document, uint32_t position);
+	void merge(const PostingList &other);
+	void remove(uint32_t document);
+	Cursor cursor() const {return Cursor(*this);}
+	size_t size() const {return size_;}
+
+	const Document* document_data() const
+	{return view_bytes_ ? view_documents_ : documents_.data();}
+	size_t document_count() const
+	{return view_bytes_ ? view_document_count_ : documents_.size();}
+	const uint8_t* byte_data() const
+	{return view_bytes_ ? view_bytes_ : bytes_.data();}
+	size_t byte_count() const
+	{return view_bytes_ ? view_byte_count_ : bytes_.size();}
+    private:
+	std::vector<uint32_t> decode(const Document &doc) const;
+	std::pair<const uint8_t*, const uint8_t*> range(const Document *doc) const;
+	void replace(std::vector<Document>::iterator doc,
+		     const std::vector<uint32_t> &positions);
+	void detach();
+
+	std::vector<Document> documents_;
+	std::vector<uint8_t> bytes_;
+	const Document *view_documents_;
+	size_t view_document_count_;
+	const uint8_t *view_bytes_;
+	size_t view_byte_count_;
+	std::shared_ptr<const void> owner_;
+	size_t size_;
+    };
+
+    // What a file looked like when it was indexed; a rescan only rehashes
+    // files whose metadata no longer matches.
+    struct FileInfo {
+	FileInfo() : size(0), mtime(0), inode(0) {}
+	bool operator==(const FileInfo &info) const
+	{return size == info.size && mtime == info.mtime && inode == info.inode;}
+	bool operator!=(const FileInfo &info) const {return !(*this == info);}
+
+	uint64_t size;
+	int64_t mtime;	// nanoseconds since the epoch
+	uint64_t inode;
+    };
+    bool stat_file(const std::string &path, FileInfo &info);
+
+    // Bump-pointer allocation out of large blocks that are only given back
+    // all at once, when the arena is destroyed or reset. Not thread-safe.
+    // Nothing is freed one by one, so containers that rehash or erase
+    // belong elsewhere.
+    class Arena {
+    public:
+	struct Options {
+	    Options() : block_size(1 << 21), huge_pages(false) {}
+	    size_t block_size;
+	    bool huge_pages;	// back blocks with transparent huge pages where available
+	};
+
+	Arena(const Options &options = Options());
+	~Arena();
+	void* allocate(size_t size, size_t alignment);
+	// Gives back every block but the first and starts over in it; what
+	// was allocated before must no longer be in use.
+	void reset();
+	size_t capacity() const {return capacity_;}	// bytes reserved from the system
+	size_t used() const {return used_;}
+    private:
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+	void grow(size_t size);
+
+	Options options_;
+	std::vector<std::pair<void*, size_t>> blocks_;
+	char *next_;
+	char *end_;
+	size_t capacity_;
+	size_t used_;
+    };
+
+    // Standard allocator over an Arena. Deallocation is a no-op; every
+    // copy shares ownership of the arena, so whatever was allocated from
+    // it, e.g. a posting list handed out by shared_ptr, keeps it alive.
+    template <typename T>
+    class ArenaAllocator {
+    public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template <typename U> struct rebind {typedef ArenaAllocator<U> other;};
+
+	ArenaAllocator(std::shared_ptr<Arena> arena) : arena_(arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) {}
+
+	T* allocate(size_t n) {return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));}
+	void deallocate(T*, size_t) {}
+	const std::shared_ptr<Arena>& arena() const {return arena_;}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U> &other) const {return arena_ == other.arena();}
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U> &other) const {return arena_ != other.arena();}
+    private:
+	std::shared_ptr<Arena> arena_;
+    };
+
+    class MemoryDriver;
+
     class Driver {
     public:
+	virtual ~Driver() {}
         virtual void add(const Record &rec) = 0;
-        virtual std::set<Record> lookup(int char1, int char2) const = 0;
-	virtual void register_path(const Path &path, const std::string &digest) = 0;
+	// The postings of a bigram, shared rather than copied where the
+	// driver keeps them.
+	virtual std::shared_ptr<const PostingList> postings(int char1, int char2) const = 0;
+	// Calls visitor(document, position) for every posting of a bigram in
+	// ascending order, decoding in place.
+	void scan(int char1, int char2,
+		  const std::function<void(uint32_t, uint32_t)> &visitor) const;
+	// A copy of the postings as records, for convenience.
+        std::set<Record> lookup(int char1, int char2) const;
+	// Postings of several bigrams, in the order given. Drivers that pay a
+	// round trip per query fetch them all at once. Given `documents`
+	// (ascending), the lists need only cover those documents.
+	virtual std::vector<std::shared_ptr<const PostingList>>
+	postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+		       const std::vector<uint32_t> *documents = nullptr) const;
+	// The documents of each bigram in ascending order, so that queries can
+	// rule documents out before reading positions. Drivers that keep
+	// postings in memory return false; their cursors skip whole documents
+	// anyway.
+	virtual bool documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+				     std::vector<std::vector<uint32_t>> &documents) const;
+	// A path maps to the digest of its current content; registering it
+	// again replaces the previous mapping.
+	virtual void register_path(const Path &path, const std::string &digest,
+				   const FileInfo &info = FileInfo()) = 0;
 	virtual std::set<Path> lookup_digest(const std::string &digest) = 0;
+	virtual bool lookup_path(const Path &path, std::string &digest, FileInfo &info) = 0;
+	virtual void unregister_path(const Path &path) = 0;
+	// Drops every posting of a document.
+	virtual void remove_document(const std::string &digest) = 0;
+
+	// Groups the adds that follow into one unit of work, e.g. a single
+	// transaction. Batches may nest; only the outermost one commits.
+	virtual void begin_batch() {}
+	virtual void commit_batch() {}
+	virtual void rollback_batch() {}
+	void add_batch(const std::vector<Record> &recs);
+
+	// Copies every posting and path of an in-memory segment.
+	virtual void merge(const MemoryDriver &segment);
     };
+    // Keeps the postings in process memory. The posting lists are
+    // allocated from an arena of the driver; lists removed from the driver
+    // keep their memory until the driver and every list it handed out are
+    // gone. The hash table, which rehashes and erases, uses the heap.
     class MemoryDriver : public Driver {
     public:
+	MemoryDriver(const Arena::Options &options = Arena::Options());
         void add(const Record &rec);
-        std::set<Record> lookup(int char1, int char2) const;
-	void register_path(const Path &path, const std::string &digest);
+	std::shared_ptr<const PostingList> postings(int char1, int char2) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
 	std::set<Path> lookup_digest(const std::string &digest);
+	bool lookup_path(const Path &path, std::string &digest, FileInfo &info);
+	void unregister_path(const Path &path);
+	void remove_document(const std::string &digest);
+	void merge(const MemoryDriver &segment);
+	void for_each(const std::function<void(int, int, const PostingList&)> &visitor) const;
+	void for_each_path(const std::function<void(const Path&, const std::string&,
+						    const FileInfo&)> &visitor) const;
+	// Approximate bytes held: the arena plus the encoded postings.
+	size_t memory_usage() const;
+	// Drops every posting and path, for reuse as a staging area. The
+	// arena is reset unless a list handed out is still alive.
+	void clear();
     private:
-        std::set<Record> records_;
+	static uint64_t key(int char1, int char2);
+
+	Arena::Options options_;
+	std::shared_ptr<Arena> arena_;
+	// (char1, char2) packed into one word -> postings of that bigram
+	std::unordered_map<uint64_t, std::shared_ptr<PostingList>> postings_;
 	std::map<const std::string, std::set<Path>> path_digest_map_;
+	std::map<Path, std::pair<std::string, FileInfo>> path_info_;
+    };
+    // An in-memory index that can be searched while it is written to.
+    // Readers get the postings of an immutable snapshot; writers add to a
+    // delta that is merged into the touched parts of a new snapshot and
+    // published with a pointer swap, so a search never waits
+    // for an add. Lists grow in place past what older snapshots see, so a
+    // publish only copies the postings it adds. Old snapshots are freed
+    // when their last reader lets go.
+    // Adds and path changes become visible when published: once the delta
+    // holds publish_threshold postings, or on publish(). Until then only
+    // the thread with a batch open sees them.
+    class SnapshotDriver : public Driver {
+    public:
+	struct Options {
+	    Options() : publish_threshold(1 << 20) {}
+	    size_t publish_threshold;	// postings
+	    Arena::Options arena;	// of the delta
+	};
+
+	SnapshotDriver(const Options &options = Options());
+        void add(const Record &rec);
+	std::shared_ptr<const PostingList> postings(int char1, int char2) const;
+	std::vector<std::shared_ptr<const PostingList>>
+	postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+		       const std::vector<uint32_t> *documents = nullptr) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
+	std::set<Path> lookup_digest(const std::string &digest);
+	bool lookup_path(const Path &path, std::string &digest, FileInfo &info);
+	void unregister_path(const Path &path);
+	void remove_document(const std::string &digest);
+	void begin_batch();
+	void commit_batch();
+	void rollback_batch();
+	void merge(const MemoryDriver &segment);
+	void publish();
+    private:
+	enum {SHARDS = 64};
+	// Encoded postings of one bigram with room to grow. Published lists
+	// are views of a prefix; a publish appends past every prefix handed
+	// out, or moves to a new store, so readers never see a write.
+	struct Store {
+	    std::vector<PostingList::Document> documents;
+	    std::vector<uint8_t> bytes;
+	    size_t size;
+	};
+	struct Entry {
+	    std::shared_ptr<const PostingList> list;
+	    std::shared_ptr<Store> store;	// null once the list is a copy
+	};
+	typedef std::unordered_map<uint64_t, Entry> Shard;
+	struct Snapshot {
+	    std::shared_ptr<const Shard> shards[SHARDS];
+	};
+	struct PathChange {
+	    PathChange(const Path &path, bool registered, const std::string &digest,
+		       const FileInfo &info)
+		: path(path), registered(registered), digest(digest), info(info) {}
+	    Path path;
+	    bool registered;
+	    std::string digest;
+	    FileInfo info;
+	};
+	// what a batch level adds, undone by dropping it
+	struct Batch {
+	    std::shared_ptr<MemoryDriver> postings;
+	    std::vector<PathChange> paths;
+	};
+
+	SnapshotDriver(const SnapshotDriver&);
+	static uint64_t key(int char1, int char2);
+	static size_t shard(uint64_t key);
+	static std::shared_ptr<const PostingList> find(const Snapshot &snapshot,
+						       int char1, int char2);
+	static Entry copy(const PostingList &list);
+	static bool append(Entry &entry, const PostingList &list);
+	static void publish_view(Entry &entry);
+	std::shared_ptr<const Snapshot> snapshot() const;
+	void swap(const std::shared_ptr<const Snapshot> &snapshot);
+	void change_path(const PathChange &change);
+	bool pending_paths_visible();
+	void publish_delta();
+	std::shared_ptr<MemoryDriver> staging();
+	void recycle(const std::shared_ptr<MemoryDriver> &driver);
+
+	Options options_;
+
+	// held only to copy or replace the pointer; GCC 4.8 has no atomic
+	// operations on shared_ptr
+	mutable std::mutex snapshot_mutex_;
+	std::shared_ptr<const Snapshot> snapshot_;
+
+	// held by a writer from the start of its outermost batch to the end
+	std::recursive_mutex writer_mutex_;
+	std::vector<Batch> batches_;		// open batches, innermost last
+	std::shared_ptr<MemoryDriver> delta_;	// committed, not yet published
+	size_t delta_size_;
+	std::vector<PathChange> delta_paths_;	// applied after delta_ is published
+	// cleared drivers for the next batches, so that their arenas and
+	// tables are reused rather than rebuilt for every file
+	std::vector<std::shared_ptr<MemoryDriver>> spare_;
+
+	std::mutex path_mutex_;
+	MemoryDriver paths_;			// published
+	std::thread::id writer_;		// the thread with batches open
     };
     class SQLiteDriver : public Driver {
     public:
-        SQLiteDriver(const std::string &filename);
+	struct Options {
+	    Options() : journal_mode("WAL"), synchronous("NORMAL"), cache_size(-65536) {}
+	    std::string journal_mode;
+	    std::string synchronous;
+	    int cache_size;	// PRAGMA cache_size; negative values are KiB
+	};
+
+        SQLiteDriver(const std::string &filename, const Options &options = Options());
+	~SQLiteDriver();
         void add(const Record &rec);
-        std::set<Record> lookup(int char1, int char2) const;
-	void register_path(const Path &path, const std::string &digest);
+	std::shared_ptr<const PostingList> postings(int char1, int char2) const;
+	std::vector<std::shared_ptr<const PostingList>>
+	postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+		       const std::vector<uint32_t> *documents = nullptr) const;
+	bool documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+			     std::vector<std::vector<uint32_t>> &documents) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
 	std::set<Path> lookup_digest(const std::string &digest);
+	bool lookup_path(const Path &path, std::string &digest, FileInfo &info);
+	void unregister_path(const Path &path);
+	void remove_document(const std::string &digest);
+	void begin_batch();
+	void commit_batch();
+	void rollback_batch();
     private:
 	SQLiteDriver();
-	void prepare_insert_statement();
+	void exec(const std::string &sql);
+	sqlite3_stmt* prepare(const std::string &sql);
+	void check(int rc) const;
 
 	sqlite3 *db_;
 	sqlite3_stmt *insert_statement_;
+	sqlite3_stmt *lookup_statement_;
+	sqlite3_stmt *register_statement_;
+	sqlite3_stmt *lookup_digest_statement_;
+	sqlite3_stmt *lookup_path_statement_;
+	sqlite3_stmt *unregister_statement_;
+	sqlite3_stmt *remove_document_statement_;
+	sqlite3_stmt *insert_document_statement_;
+	sqlite3_stmt *documents_statement_;
+	sqlite3_stmt *document_postings_statement_;
+	sqlite3_stmt *remove_bigram_documents_statement_;
+	int batch_depth_;
+	uint64_t batch_start_;	// nanoseconds, of the outermost batch
+
+	// digest of the document added last, to avoid a table lookup per record,
+	// and the bigrams already noted for it in bigram_document
+	uint32_t last_document_;
+	std::string last_docid_;
+	std::set<std::pair<int, int>> last_bigrams_;
+    };
+
+    // Read-only driver over an index file written by MmapDriver::write.
+    // Posting lists point straight into the mapping, so opening an index
+    // costs one pass over its document table and processes that map the
+    // same file share its pages.
+    class MmapDriver : public Driver {
+    public:
+	MmapDriver(const std::string &filename);
+	static void write(const std::string &filename, const MemoryDriver &source);
+
+        void add(const Record &rec);
+	std::shared_ptr<const PostingList> postings(int char1, int char2) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
+	std::set<Path> lookup_digest(const std::string &digest);
+	bool lookup_path(const Path &path, std::string &digest, FileInfo &info);
+	void unregister_path(const Path &path);
+	void remove_document(const std::string &digest);
+    private:
+	MmapDriver();
+	template <typename T> const T* at(uint64_t offset, uint64_t count) const;
+
+	std::shared_ptr<const void> mapping_;
+	const uint8_t *data_;
+	size_t size_;
+	const void *bigrams_;
+	size_t bigram_count_;
+	const void *paths_;
+	size_t path_count_;
+
+	// document ids of the file -> interned ordinals, and back
+	std::vector<uint32_t> documents_;
+	std::unordered_map<uint32_t, uint32_t> local_documents_;
+	bool identity_;
+    };
+
+    // Keeps the index in a Redis server, one sorted set of positions per
+    // document and bigram under "2g:index:<hex digest>:<bigram>". Writes
+    // are pipelined and sent when a batch commits or the pipeline fills up.
+    // Batches are not transactions: a large document reaches the server
+    // before its batch ends, so rolling back deletes the postings of every
+    // document the batch added to. Path changes are held back until the
+    // outermost batch commits, and a rollback drops them. Removals made in
+    // a failed batch stay removed.
+    class RedisDriver : public Driver {
+    public:
+        RedisDriver(const std::string &host = "localhost", unsigned short port = 6379);
+	~RedisDriver();
+	// "host[:port]", the port defaulting to 6379
+	static void split_address(const std::string &address, std::string &host,
+				  unsigned short &port);
+        void add(const Record &rec);
+	std::shared_ptr<const PostingList> postings(int char1, int char2) const;
+	std::vector<std::shared_ptr<const PostingList>>
+	postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+		       const std::vector<uint32_t> *documents = nullptr) const;
+	bool documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+			     std::vector<std::vector<uint32_t>> &documents) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
+	std::set<Path> lookup_digest(const std::string &digest);
+	bool lookup_path(const Path &path, std::string &digest, FileInfo &info);
+	void unregister_path(const Path &path);
+	void remove_document(const std::string &digest);
+	void begin_batch();
+	void commit_batch();
+	void rollback_batch();
+    private:
+	// One RESP reply; arrays are only ever arrays of bulk strings here.
+	struct Reply {
+	    Reply() : type(0), integer(0), nil(false) {}
+	    char type;
+	    std::string str;
+	    int64_t integer;
+	    bool nil;
+	    std::vector<std::string> elements;
+	};
+
+	struct PathChange {
+	    bool registered;	// or unregistered
+	    std::string digest;
+	    FileInfo info;
+	};
+
+	// What an open batch did, for its rollback.
+	struct Batch {
+	    Batch() : last_document(uint32_t(-1)) {}
+	    std::set<std::string> documents;	// hex digests added to
+	    uint32_t last_document;
+	    std::map<std::string, PathChange> paths;
+	};
+
+	RedisDriver();
+	RedisDriver(const RedisDriver&);
+	std::vector<std::vector<std::pair<uint32_t, std::string>>>
+	bigram_documents(const std::vector<std::string> &texts) const;
+	static std::string encode(const std::vector<std::string> &args);
+	void command(const std::vector<std::string> &args) const;
+	std::vector<Reply> flush() const;
+	Reply call(const std::vector<std::string> &args) const;
+	Reply query(const std::vector<std::string> &args) const;
+	void send(const std::string &data) const;
+	Reply receive() const;
+	void disconnect() const;
+	void fill() const;
+	std::string read_line() const;
+	Reply read_reply() const;
+	void change_path(const std::string &path, const PathChange &change);
+	void apply_paths(const std::map<std::string, PathChange> &paths);
+	void remove_postings(const std::string &hexdigest);
+
+	mutable int socket_;
+	mutable std::string out_;
+	mutable std::string in_;
+	mutable size_t in_pos_;
+	mutable size_t pending_;
+	std::vector<Batch> batches_;	// innermost last
+
+	// the hex digest of the document added to last
+	uint32_t last_document_;
+	std::string last_hexdigest_;
+
+	// index keys written since the last flush, so the bigram and document
+	// sets are only added to once per key
+	mutable std::set<std::string> noted_;
+    };
+
+    // Keeps the most recently used posting lists of another driver, up to
+    // a budget in bytes. Adding to a bigram drops its list; removing a
+    // document drops them all. A list fetched while the driver was being
+    // written to is returned but not kept, as it may already be stale.
+    // The bigrams a batch touched are dropped again when it commits, for
+    // drivers that only show writes then. A driver that holds writes back
+    // past their batch, as SnapshotDriver below its publish threshold
+    // does, needs clear() once it shows them.
+    class CachingDriver : public Driver {
+    public:
+	CachingDriver(std::shared_ptr<Driver> driver, size_t capacity);
+        void add(const Record &rec);
+	std::shared_ptr<const PostingList> postings(int char1, int char2) const;
+	std::vector<std::shared_ptr<const PostingList>>
+	postings_batch(const std::vector<std::pair<int, int>> &bigrams,
+		       const std::vector<uint32_t> *documents = nullptr) const;
+	bool documents_batch(const std::vector<std::pair<int, int>> &bigrams,
+			     std::vector<std::vector<uint32_t>> &documents) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
+	std::set<Path> lookup_digest(const std::string &digest);
+	bool lookup_path(const Path &path, std::string &digest, FileInfo &info);
+	void unregister_path(const Path &path);
+	void remove_document(const std::string &digest);
+	void begin_batch();
+	void commit_batch();
+	void rollback_batch();
+	void merge(const MemoryDriver &segment);
+
+	size_t hits() const;
+	size_t misses() const;
+	size_t size() const;	// bytes held
+	void clear();
+    private:
+	struct Entry {
+	    Entry(uint64_t key, const std::shared_ptr<const PostingList> &list, size_t cost)
+		: key(key), list(list), cost(cost) {}
+	    uint64_t key;
+	    std::shared_ptr<const PostingList> list;
+	    // as inserted: the list of a live driver may grow afterwards
+	    size_t cost;
+	};
+
+	static uint64_t key(int char1, int char2);
+	static size_t cost(const PostingList &list);
+	bool find(uint64_t key, std::shared_ptr<const PostingList> &list,
+		  bool count = true) const;
+	uint64_t generation() const;
+	void insert(uint64_t key, const std::shared_ptr<const PostingList> &list,
+		    uint64_t generation) const;
+	void erase(uint64_t key);
+
+	std::shared_ptr<Driver> driver_;
+	size_t capacity_;
+
+	// written only by the thread with the batch open
+	int batch_depth_;
+	std::set<uint64_t> batch_keys_;	// bigrams added to in the batch
+
+	mutable std::mutex mutex_;
+	// most recently used first
+	mutable std::list<Entry> entries_;
+	mutable std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+	mutable size_t size_;
+	// bumped after every write to the driver
+	uint64_t generation_;
+	mutable size_t hits_;
+	mutable size_t misses_;
+    };
+
+    // A document and how many bigrams of a query it contains.
+    class ScoredDocument {
+    public:
+	ScoredDocument(uint32_t document, unsigned int score)
+	    : document_(document), score_(score) {}
+        std::string docid() const {return DocumentTable::instance().digest(document_);}
+        uint32_t document() const {return document_;}
+	unsigned int score() const {return score_;}
+    private:
+	uint32_t document_;
+	unsigned int score_;
     };
 
     class Dictionary {
@@ -80,15 +734,46 @@ namespace Bigram
         Dictionary(std::shared_ptr<Driver> drv);
         Dictionary();
         std::set<Record> lookup(int char1, int char2) const;
+	void scan(int char1, int char2,
+		  const std::function<void(uint32_t, uint32_t)> &visitor) const;
         void add(const Record &rec);
         void add(const std::string &fileid, const std::string &text, size_t offset);
         void add(const std::string &fileid, std::istream &is);
         void add(const Path &filepath);
+	// Indexes files on up to `threads` threads (0: one per core). Content
+	// already indexed, or met earlier in `paths`, is only mapped to its
+	// new path. Files that cannot be read or are not valid UTF-8 are left
+	// out and listed in `skipped` with the reason; without it the first
+	// one throws.
+	void add(const std::vector<Path> &paths, unsigned threads = 0,
+		 std::vector<std::pair<Path, std::string>> *skipped = nullptr);
+	// Brings the index up to date with the given files: unchanged files
+	// are recognized by their metadata, changed ones are re-indexed and
+	// missing ones are dropped. Files that cannot be read or are not
+	// valid UTF-8 are left out as with add().
+	void sync(const std::vector<Path> &paths,
+		  std::vector<std::pair<Path, std::string>> *skipped = nullptr);
         std::list<Position> search(const std::string &text) const;
-	void register_path(const Path &path, const std::string &digest);
+	// Searches several phrases at once: each distinct bigram is fetched
+	// once for all of them, and the phrases are matched on up to
+	// `threads` threads (0: one per core). Results are in query order.
+	std::vector<std::list<Position>>
+	search_many(const std::vector<std::string> &texts, unsigned threads = 0) const;
+	// The k documents that contain the most bigrams of text, counting a
+	// bigram as often as it occurs in text; best first, ties in document
+	// order.
+	std::vector<ScoredDocument> search_ranked(const std::string &text, size_t k) const;
+	void register_path(const Path &path, const std::string &digest,
+			   const FileInfo &info = FileInfo());
 	std::set<Path> lookup_digest(const std::string &digest);
 
     private:
+	void add_path(const Path &filepath, std::string &hash);
+	void add_line(uint32_t document, const char *begin, const char *end, size_t offset);
+	void add_file(const Path &filepath, const std::string &hash,
+		      const char *begin, const char *end, const FileInfo &info);
+	void remove_path(const Path &path, const std::string &digest);
+
         std::shared_ptr<Driver> driver_;
     };
 
@@ -102,6 +787,31 @@ namespace Bigram
     };
     std::vector<std::pair<CodePoint, size_t>> disassemble(const std::string &text);
 
+    // Decodes a UTF-8 string on the fly and yields each pair of adjacent
+    // code points with the byte offset of the first one.
+    class BigramCursor {
+    public:
+	BigramCursor(const char *begin, const char *end);
+	BigramCursor(const std::string &text);
+	bool valid() const {return valid_;}
+	int first() const {return first_;}
+	int second() const {return second_;}
+	size_t offset() const {return offset_;}
+	void next();
+    private:
+	BigramCursor();
+	void decode(int &cp, size_t &offset);
+
+	const char *begin_;
+	const char *p_;
+	const char *end_;
+	bool valid_;
+	int first_;
+	int second_;
+	size_t offset_;
+	size_t second_offset_;
+    };
+
     std::string digest_file(const std::string &path);
 }
 
@@ -0,0 +1,120 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+#include "Corpus.hh"
+
+namespace
+{
+    void append_utf8(std::string &dest, uint32_t cp)
+    {
+	if (cp < 0x80) {
+	    dest += char(cp);
+	} else if (cp < 0x800) {
+	    dest += char(0xc0 | (cp >> 6));
+	    dest += char(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+	    dest += char(0xe0 | (cp >> 12));
+	    dest += char(0x80 | ((cp >> 6) & 0x3f));
+	    dest += char(0x80 | (cp & 0x3f));
+	} else {
+	    dest += char(0xf0 | (cp >> 18));
+	    dest += char(0x80 | ((cp >> 12) & 0x3f));
+	    dest += char(0x80 | ((cp >> 6) & 0x3f));
+	    dest += char(0x80 | (cp & 0x3f));
+	}
+    }
+
+    // A generator for document n alone, so that documents do not depend
+    // on the order they were asked for in.
+    std::mt19937_64 document_rng(uint32_t seed, uint64_t n)
+    {
+	std::seed_seq seq{seed, uint32_t(n), uint32_t(n >> 32)};
+	return std::mt19937_64(seq);
+    }
+}
+
+Corpus::Generator::Generator(const Options &options)
+    : options_(options)
+{
+    if (options.vocabulary == 0 || options.min_line > options.max_line
+	|| options.min_lines > options.max_lines || options.max_lines == 0)
+	throw std::string("Corpus: bad options");
+
+    std::mt19937 rng(options.seed);
+    std::uniform_real_distribution<double> script(0.0, 1.0);
+    // ASCII words favour common letters, as English does
+    std::geometric_distribution<int> letter(0.15);
+    std::uniform_int_distribution<int> ascii_length(2, 10);
+    std::uniform_int_distribution<int> cjk_length(1, 4);
+    std::uniform_int_distribution<int> emoji_length(1, 2);
+    std::uniform_int_distribution<int> kind(0, 2);
+    std::uniform_int_distribution<uint32_t> kana(0x3042, 0x3093);
+    std::uniform_int_distribution<uint32_t> kanji(0x4e00, 0x9fff);
+    std::uniform_int_distribution<uint32_t> emoji(0x1f300, 0x1f64f);
+    static const char letters[] = "etaoinshrdlucmfwypvbgkjqxz";
+
+    words_.reserve(options.vocabulary);
+    weights_.reserve(options.vocabulary);
+    double total = 0;
+    for (size_t rank = 1; rank <= options.vocabulary; rank ++) {
+	std::string word;
+	double p = script(rng);
+	if (p < options.cjk) {
+	    for (int n = cjk_length(rng); n > 0; n --)
+		append_utf8(word, kind(rng) ? kana(rng) : kanji(rng));
+	} else if (p < options.cjk + options.emoji) {
+	    for (int n = emoji_length(rng); n > 0; n --)
+		append_utf8(word, emoji(rng));
+	} else {
+	    for (int n = ascii_length(rng); n > 0; n --)
+		word += letters[std::min(letter(rng), 25)];
+	}
+	words_.push_back(word);
+	total += 1.0 / std::pow(double(rank), options.zipf);
+	weights_.push_back(total);
+    }
+}
+
+std::string Corpus::Generator::document(uint64_t n) const
+{
+    auto rng = document_rng(options_.seed, n);
+    if (n > 0 && options_.duplicates > 0) {
+	std::uniform_real_distribution<double> duplicate(0.0, 1.0);
+	if (duplicate(rng) < options_.duplicates) {
+	    std::uniform_int_distribution<uint64_t> original(0, n - 1);
+	    return document(original(rng));
+	}
+    }
+
+    std::uniform_real_distribution<double> word(0.0, weights_.back());
+    std::uniform_int_distribution<size_t> lines(options_.min_lines, options_.max_lines);
+    std::uniform_int_distribution<size_t> length(options_.min_line, options_.max_line);
+    std::string dest;
+    for (size_t i = lines(rng); i > 0; i --) {
+	// the space after the last word becomes the newline, which does not
+	// count towards the length of the line
+	size_t eol = dest.length() + length(rng) + 1;
+	do {
+	    auto rank = std::lower_bound(weights_.begin(), weights_.end(), word(rng));
+	    if (rank == weights_.end())
+		rank --;
+	    dest += words_[rank - weights_.begin()];
+	    dest += ' ';
+	} while (dest.length() < eol);
+	dest[dest.length() - 1] = '\n';
+    }
+    return dest;
+}
+
+std::string Corpus::Generator::path(uint64_t n)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%03u/%03u/%09llu.txt",
+	     unsigned(n / 1000000 % 1000), unsigned(n / 1000 % 1000), (unsigned long long)n);
+    return buf;
+}
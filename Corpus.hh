@@ -0,0 +1,49 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+namespace Corpus
+{
+    struct Options {
+	Options()
+	    : seed(1), vocabulary(50000), zipf(1.0),
+	      min_line(20), max_line(120), min_lines(5), max_lines(40),
+	      cjk(0.1), emoji(0.02), duplicates(0.0) {}
+	uint32_t seed;
+	// Words are drawn with probability proportional to 1 / rank^zipf.
+	size_t vocabulary;
+	double zipf;
+	// Line lengths in bytes, not counting the newline, and lines per
+	// document, both uniform. A line ends with the word that reaches its
+	// length, so it may run past max_line by that word.
+	size_t min_line;
+	size_t max_line;
+	size_t min_lines;
+	size_t max_lines;
+	// Shares of the vocabulary written in CJK and in emoji; the rest
+	// is ASCII.
+	double cjk;
+	double emoji;
+	// Share of documents that are copies of an earlier one.
+	double duplicates;
+    };
+
+    // Synthetic text with a skewed vocabulary. Document n depends only on
+    // the options and n, so corpora are reproducible and can be generated
+    // in any order or in parallel.
+    class Generator {
+    public:
+	Generator(const Options &options = Options());
+	std::string document(uint64_t n) const;
+	// Zero-padded so that names sort in document order, two levels of
+	// directories keeping each one small: "000/001/000001234.txt".
+	static std::string path(uint64_t n);
+	const Options &options() const { return options_; }
+    private:
+	const Options options_;
+	std::vector<std::string> words_;
+	// Cumulative Zipf weights, for sampling words by rank.
+	std::vector<double> weights_;
+    };
+}
+
+#endif
@@ -1,26 +1,67 @@
 #include <memory>
 #include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <mutex>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <cstdio>
-#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <cppunit/extensions/HelperMacros.h>
 #include <sqlite3.h>
+#include "utf8/source/utf8.h"
 #include "Bigram.hh"
+#include "Corpus.hh"
 
 class BigramTest : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST_SUITE(BigramTest);
     CPPUNIT_TEST(test_disassemble);
     CPPUNIT_TEST(test_add);
     CPPUNIT_TEST(test_add_text);
+    CPPUNIT_TEST(test_scan);
+    CPPUNIT_TEST(test_bigram_cursor);
     CPPUNIT_TEST(test_search);
+    CPPUNIT_TEST(test_search_phrase);
+    CPPUNIT_TEST(test_search_ranked);
+    CPPUNIT_TEST(test_search_many);
     CPPUNIT_TEST(test_digest_file);
     CPPUNIT_TEST(test_add_document);
+    CPPUNIT_TEST(test_add_document_lines);
+    CPPUNIT_TEST(test_add_duplicate_content);
     CPPUNIT_TEST(test_path_digest_map);
+    CPPUNIT_TEST(test_add_parallel);
+    CPPUNIT_TEST(test_sync);
+    CPPUNIT_TEST(test_document_table);
+    CPPUNIT_TEST(test_posting_list);
+    CPPUNIT_TEST(test_arena);
+    CPPUNIT_TEST(test_corpus);
+    CPPUNIT_TEST(test_metrics);
+    CPPUNIT_TEST(test_snapshot);
 
     CPPUNIT_TEST(test_sqlite_lookup);
     CPPUNIT_TEST(test_sqlite);
+    CPPUNIT_TEST(test_sqlite_batch);
+    CPPUNIT_TEST(test_sqlite_path_map);
+    CPPUNIT_TEST(test_sqlite_documents);
+    CPPUNIT_TEST(test_caching_driver);
+    CPPUNIT_TEST(test_mmap);
+    CPPUNIT_TEST(test_redis);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -37,16 +78,59 @@ protected:
     void test_disassemble();
     void test_add();
     void test_add_text();
+    void test_scan();
+    void test_bigram_cursor();
     void test_search();
+    void test_search_phrase();
+    void test_search_ranked();
+    void test_search_many();
     void test_digest_file();
     void test_add_document();
+    void test_add_document_lines();
+    void test_add_duplicate_content();
     void test_path_digest_map();
+    void test_add_parallel();
+    void test_sync();
+    void test_document_table();
+    void test_posting_list();
+    void test_arena();
+    void test_corpus();
+    void test_metrics();
+    void test_snapshot();
     void test_sqlite_lookup();
     void test_sqlite();
+    void test_sqlite_batch();
+    void test_sqlite_path_map();
+    void test_sqlite_documents();
+    void test_caching_driver();
+    void test_mmap();
+    void test_redis();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( BigramTest );
 
+// Scratch files go to $TEST_TMPDIR, a RAM disk say, or to /tmp.
+static std::string scratch_path(const std::string &name)
+{
+    const char *dir = getenv("TEST_TMPDIR");
+    return std::string(dir ? dir : "/tmp") + "/2g-test-" + name;
+}
+
+// Runs a hook once in the middle of a fetch, standing in for a writer on
+// another thread.
+class InterleavedDriver : public Bigram::MemoryDriver {
+public:
+    std::shared_ptr<const Bigram::PostingList> postings(int char1, int char2) const {
+	auto list = Bigram::MemoryDriver::postings(char1, char2);
+	std::function<void()> hook;
+	hook.swap(during_fetch);
+	if (hook)
+	    hook();
+	return list;
+    }
+    mutable std::function<void()> during_fetch;
+};
+
 void BigramTest::setUp() {
     dict_.reset(new Bigram::Dictionary());
 
@@ -73,6 +157,30 @@ void BigramTest::test_add() {
     CPPUNIT_ASSERT(result.find(rec) != result.end());
 }
 
+void BigramTest::test_scan() {
+    dict_->add("scan-b", "hoho", 0);
+    dict_->add("scan-a", "ho", 7);
+    dict_->add("scan-b", "ho", 20);
+
+    std::vector<Bigram::Position> scanned;
+    dict_->scan('h', 'o', [&scanned](uint32_t document, uint32_t position) {
+	    scanned.push_back(Bigram::Position(document, position));
+	});
+    CPPUNIT_ASSERT_EQUAL(size_t(4), scanned.size());
+    CPPUNIT_ASSERT(std::is_sorted(scanned.cbegin(), scanned.cend()));
+
+    // lookup() is the same postings, copied, in Record's descending order
+    auto recs = dict_->lookup('h', 'o');
+    CPPUNIT_ASSERT_EQUAL(scanned.size(), recs.size());
+    auto it = scanned.crbegin();
+    for (auto &rec : recs)
+	CPPUNIT_ASSERT_EQUAL(*it++, rec.position());
+
+    size_t visits = 0;
+    dict_->scan('x', 'y', [&visits](uint32_t, uint32_t) { visits ++; });
+    CPPUNIT_ASSERT_EQUAL(size_t(0), visits);
+}
+
 void BigramTest::test_disassemble() {
     std::string text = "hogefuga";
 
@@ -95,6 +203,22 @@ void BigramTest::test_disassemble() {
     CPPUNIT_ASSERT_EQUAL(28450, int(chars_k[0].first));
     CPPUNIT_ASSERT_EQUAL(23383, int(chars_k[1].first));
     CPPUNIT_ASSERT_EQUAL(size_t(3), chars_k[1].second);
+
+    // long enough to cross several vector blocks, with multibyte
+    // characters at both aligned and unaligned offsets
+    std::string mixed;
+    for (int i = 0; i < 9; i ++) {
+	mixed += std::string(i * 7 + 1, 'a' + i);
+	mixed += (i % 2) ? "漢字" : "\xc3\xa9";
+    }
+    auto chars_m = Bigram::disassemble(mixed);
+    auto it = mixed.cbegin();
+    for (auto &ch : chars_m) {
+	CPPUNIT_ASSERT(it != mixed.cend());
+	CPPUNIT_ASSERT_EQUAL(size_t(it - mixed.cbegin()), ch.second);
+	CPPUNIT_ASSERT_EQUAL(int(utf8::next(it, mixed.cend())), int(ch.first));
+    }
+    CPPUNIT_ASSERT(it == mixed.cend());
 }
 
 void BigramTest::test_add_text() {
@@ -104,6 +228,30 @@ void BigramTest::test_add_text() {
     CPPUNIT_ASSERT_EQUAL(7, int((*(result.cbegin())).position().position()));
 }
 
+void BigramTest::test_bigram_cursor() {
+    std::string text = "a漢字b";
+    Bigram::BigramCursor cur(text);
+
+    int expected[][3] = {{'a', 28450, 0}, {28450, 23383, 1}, {23383, 'b', 4}};
+    for (auto &e : expected) {
+	CPPUNIT_ASSERT(cur.valid());
+	CPPUNIT_ASSERT_EQUAL(e[0], cur.first());
+	CPPUNIT_ASSERT_EQUAL(e[1], cur.second());
+	CPPUNIT_ASSERT_EQUAL(size_t(e[2]), cur.offset());
+	cur.next();
+    }
+    CPPUNIT_ASSERT(!cur.valid());
+
+    CPPUNIT_ASSERT(!Bigram::BigramCursor(std::string("x")).valid());
+    CPPUNIT_ASSERT(!Bigram::BigramCursor(std::string()).valid());
+
+    // positions are byte offsets, so phrases after multibyte text are found
+    dict_->add(fileid_, "漢字カタカナ", 0);
+    auto result = dict_->search("カナ");
+    CPPUNIT_ASSERT_EQUAL(1, int(result.size()));
+    CPPUNIT_ASSERT_EQUAL(Bigram::Position(fileid_, 12), *(result.cbegin()));
+}
+
 void BigramTest::test_search() {
     dict_->add(fileid_, text_, 0);
 
@@ -115,6 +263,138 @@ void BigramTest::test_search() {
     CPPUNIT_ASSERT_EQUAL(*(result.cbegin()), Bigram::Position(fileid_, pos));
 }
 
+void BigramTest::test_search_phrase() {
+    dict_->add("phrase-a", "abcabcabd", 0);
+    dict_->add("phrase-b", "xxabd", 0);
+    dict_->add("phrase-c", "aaa", 0);
+    for (int i = 0; i < 100; i ++)
+	dict_->add("phrase-d", "ab", i * 10);
+
+    auto result = dict_->search("bcab");
+    CPPUNIT_ASSERT_EQUAL(2, int(result.size()));
+    CPPUNIT_ASSERT_EQUAL(Bigram::Position("phrase-a", 1), result.front());
+    CPPUNIT_ASSERT_EQUAL(Bigram::Position("phrase-a", 4), result.back());
+
+    result = dict_->search("abd");
+    CPPUNIT_ASSERT_EQUAL(2, int(result.size()));
+    std::set<Bigram::Position> found(result.cbegin(), result.cend());
+    CPPUNIT_ASSERT(found.count(Bigram::Position("phrase-a", 6)));
+    CPPUNIT_ASSERT(found.count(Bigram::Position("phrase-b", 2)));
+
+    // repeated bigrams must each match at their own offset
+    result = dict_->search("aa");
+    CPPUNIT_ASSERT_EQUAL(2, int(result.size()));
+    result = dict_->search("aaa");
+    CPPUNIT_ASSERT_EQUAL(1, int(result.size()));
+    CPPUNIT_ASSERT_EQUAL(Bigram::Position("phrase-c", 0), result.front());
+
+    // the rarest bigram sits at the end of the query, and its first
+    // posting in phrase-b is too close to the start of the line
+    dict_->add("phrase-b", "dy", 2);
+    result = dict_->search("xxabdy");
+    CPPUNIT_ASSERT(result.empty());
+
+    CPPUNIT_ASSERT(dict_->search("abx").empty());
+    CPPUNIT_ASSERT(dict_->search("a").empty());
+    CPPUNIT_ASSERT(dict_->search("").empty());
+}
+
+void BigramTest::test_search_ranked() {
+    const char *texts[] = {
+	"quick brown fox", "the quick brown dog", "brown", "quick fox jumps",
+	"lazy dog", "the quick brown fox jumps over the lazy dog", "fox fox fox",
+    };
+    std::vector<std::string> ids;
+    for (int i = 0; i < 7; i ++) {
+	std::ostringstream id;
+	id << "ranked-" << i;
+	ids.push_back(id.str());
+	dict_->add(id.str(), texts[i], 0);
+    }
+
+    // every document scored by brute force
+    std::string query = "quick brown fox";
+    std::vector<std::pair<int, uint32_t>> expected;
+    for (auto &id : ids) {
+	uint32_t document = Bigram::DocumentTable::instance().intern(id);
+	int score = 0;
+	for (Bigram::BigramCursor bg(query); bg.valid(); bg.next()) {
+	    for (auto &rec : dict_->lookup(bg.first(), bg.second())) {
+		if (rec.position().document() == document) {
+		    score ++;
+		    break;
+		}
+	    }
+	}
+	if (score > 0)
+	    expected.push_back(std::make_pair(-score, document));
+    }
+    std::sort(expected.begin(), expected.end());
+
+    for (size_t k = 1; k <= expected.size() + 1; k ++) {
+	auto result = dict_->search_ranked(query, k);
+	CPPUNIT_ASSERT_EQUAL(std::min(k, expected.size()), result.size());
+	for (size_t i = 0; i < result.size(); i ++) {
+	    CPPUNIT_ASSERT_EQUAL(unsigned(-expected[i].first), result[i].score());
+	    CPPUNIT_ASSERT_EQUAL(expected[i].second, result[i].document());
+	}
+    }
+    auto best = dict_->search_ranked(query, 2);
+    CPPUNIT_ASSERT_EQUAL(std::string("ranked-0"), best[0].docid());
+    CPPUNIT_ASSERT_EQUAL(std::string("ranked-5"), best[1].docid());
+
+    // repeated bigrams count as often as they occur in the query
+    best = dict_->search_ranked("fox fox", 1);
+    CPPUNIT_ASSERT_EQUAL(6u, best[0].score());
+    // "fox fox fox" scores the same but comes later
+    CPPUNIT_ASSERT_EQUAL(std::string("ranked-3"), best[0].docid());
+    CPPUNIT_ASSERT(dict_->search_ranked("zzz", 3).empty());
+    CPPUNIT_ASSERT(dict_->search_ranked(query, 0).empty());
+}
+
+void BigramTest::test_search_many() {
+    remove(scratch_path("test8.sqlite").c_str());
+    std::shared_ptr<Bigram::Driver> sqlite(new Bigram::SQLiteDriver(scratch_path("test8.sqlite")));
+    std::shared_ptr<Bigram::CachingDriver> cache(
+	new Bigram::CachingDriver(std::shared_ptr<Bigram::Driver>(new Bigram::MemoryDriver), 1 << 20));
+    std::shared_ptr<Bigram::Driver> drivers[] = {sqlite, cache};
+
+    std::vector<std::string> queries;
+    queries.push_back("ultrices");
+    queries.push_back("blandit vel");
+    queries.push_back("vel");
+    queries.push_back("");
+    queries.push_back("nothing like this");
+    queries.push_back("ultrices");
+    queries.push_back("lacus");
+    std::set<std::pair<int, int>> distinct;
+    for (auto &query : queries) {
+	for (Bigram::BigramCursor bg(query); bg.valid(); bg.next())
+	    distinct.insert(std::make_pair(bg.first(), bg.second()));
+    }
+
+    for (auto &drv : drivers) {
+	Bigram::Dictionary dict(drv);
+	dict.add(Bigram::Path("test/lipsum.txt"));
+	dict.add(fileid_, text_, 0);
+
+	size_t misses = cache->misses();
+	auto results = dict.search_many(queries, 3);
+	CPPUNIT_ASSERT_EQUAL(queries.size(), results.size());
+	if (drv == cache)
+	    CPPUNIT_ASSERT_EQUAL(distinct.size(), cache->misses() - misses);
+
+	for (size_t i = 0; i < queries.size(); i ++) {
+	    auto expected = dict.search(queries[i]);
+	    CPPUNIT_ASSERT_EQUAL(expected.size(), results[i].size());
+	    CPPUNIT_ASSERT(std::equal(expected.cbegin(), expected.cend(), results[i].cbegin()));
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(4), results[0].size());
+	CPPUNIT_ASSERT(results[3].empty());
+	CPPUNIT_ASSERT(results[4].empty());
+    }
+}
+
 void BigramTest::test_digest_file() {
     std::string hash = Bigram::digest_file("test/lipsum.txt");
     CPPUNIT_ASSERT_EQUAL(std::string("\xb1\xf3\xa9\x36\x95\x33\xe3\x53\x92\xb3"
@@ -134,6 +414,67 @@ void BigramTest::test_add_document() {
     CPPUNIT_ASSERT(paths.find(Bigram::Path("test/lipsum.txt")) != paths.end());
 }
 
+void BigramTest::test_add_document_lines() {
+    {
+	std::ofstream os(scratch_path("lines.txt"));
+	os << "first line\nsecond line\n\nlast line without newline";
+    }
+    dict_->add(Bigram::Path(scratch_path("lines.txt")));
+
+    // offsets count the bytes of the preceding lines without newlines
+    auto result = dict_->search("last line");
+    CPPUNIT_ASSERT_EQUAL(1, int(result.size()));
+    CPPUNIT_ASSERT_EQUAL(21u, result.front().position());
+    CPPUNIT_ASSERT(dict_->search("linesecond").empty());
+
+    // the digest ignores newlines, as it always has
+    {
+	std::ofstream os(scratch_path("lines2.txt"));
+	os << "first linesecond line\nlast line without newline\n";
+    }
+    CPPUNIT_ASSERT_EQUAL(Bigram::digest_file(scratch_path("lines.txt")),
+			 Bigram::digest_file(scratch_path("lines2.txt")));
+    CPPUNIT_ASSERT_EQUAL(result.front().docid(),
+			 Bigram::digest_file(scratch_path("lines.txt")));
+
+    std::ofstream(scratch_path("empty.txt"));
+    dict_->add(Bigram::Path(scratch_path("empty.txt")));
+    CPPUNIT_ASSERT_EQUAL(1, int(dict_->lookup_digest(
+				    Bigram::digest_file(scratch_path("empty.txt"))).size()));
+
+    bool thrown = false;
+    try {
+	dict_->add(Bigram::Path(scratch_path("no-such-file.txt")));
+    } catch (const std::string &) {
+	thrown = true;
+    }
+    CPPUNIT_ASSERT(thrown);
+}
+
+void BigramTest::test_add_duplicate_content() {
+    {
+	std::ifstream is("test/lipsum.txt");
+	std::ofstream os(scratch_path("lipsum-copy.txt"));
+	os << is.rdbuf();
+    }
+
+    remove(scratch_path("test5.sqlite").c_str());
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver(scratch_path("test5.sqlite")));
+    Bigram::Dictionary sqlite(drv);
+
+    Bigram::Dictionary *dicts[] = {dict_.get(), &sqlite};
+    for (auto dict : dicts) {
+	dict->add(Bigram::Path("test/lipsum.txt"));
+	dict->add(Bigram::Path(scratch_path("lipsum-copy.txt")));
+	dict->add(Bigram::Path("test/lipsum.txt"));
+
+	CPPUNIT_ASSERT_EQUAL(size_t(4), dict->search("ultrices").size());
+	auto paths = dict->lookup_digest(Bigram::digest_file("test/lipsum.txt"));
+	CPPUNIT_ASSERT_EQUAL(2, int(paths.size()));
+	CPPUNIT_ASSERT(paths.find(Bigram::Path(scratch_path("lipsum-copy.txt"))) != paths.end());
+    }
+}
+
 void BigramTest::test_path_digest_map() {
     dict_->register_path(Bigram::Path("test/lipsum.txt"),
 			 "\xb1\xf3\xa9\x36\x95\x33\xe3\x53\x92\xb3"
@@ -149,10 +490,528 @@ void BigramTest::test_path_digest_map() {
     CPPUNIT_ASSERT(paths.find(Bigram::Path("test/another.txt")) != paths.end());
 }
 
+void BigramTest::test_add_parallel() {
+    std::vector<Bigram::Path> paths;
+    for (int i = 0; i < 12; i ++) {
+	std::ostringstream name;
+	name << scratch_path("parallel") << i << ".txt";
+	std::ofstream os(name.str());
+	os << "file " << i << " of the parallel ingest test" << std::endl
+	   << text_ << std::endl;
+	paths.push_back(Bigram::Path(name.str()));
+    }
+    // the same content under a second path ends up in another segment
+    paths.push_back(Bigram::Path("test/lipsum.txt"));
+    paths.insert(paths.begin(), Bigram::Path("test/lipsum.txt"));
+
+    Bigram::Dictionary serial;
+    for (auto &path : paths)
+	serial.add(path);
+    dict_->add(paths, 4);
+
+    const char *phrases[] = {"ultrices", "parallel ingest", "file 7 ", "blandit vel"};
+    for (auto phrase : phrases) {
+	auto expected = serial.search(phrase);
+	auto result = dict_->search(phrase);
+	CPPUNIT_ASSERT_EQUAL(expected.size(), result.size());
+	CPPUNIT_ASSERT(std::equal(expected.cbegin(), expected.cend(), result.cbegin()));
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(4), dict_->search("ultrices").size());
+    CPPUNIT_ASSERT_EQUAL(size_t(12), dict_->search("ingest test").size());
+    CPPUNIT_ASSERT_EQUAL(1, int(dict_->lookup_digest(Bigram::digest_file("test/lipsum.txt")).size()));
+
+    // content indexed already is not tokenized again, only mapped
+    Bigram::Metrics &metrics = Bigram::Metrics::instance();
+    uint64_t inserted = metrics.snapshot().counters[Bigram::Metrics::RECORDS_INSERTED];
+    std::vector<Bigram::Path> again(paths.begin(), paths.begin() + 4);
+    again.push_back(Bigram::Path(scratch_path("parallel-copy.txt")));
+    {
+	std::ofstream os(scratch_path("parallel-copy.txt").c_str());
+	os << "file 3 of the parallel ingest test" << std::endl << text_ << std::endl;
+    }
+    dict_->add(again, 4);
+    CPPUNIT_ASSERT_EQUAL(inserted, metrics.snapshot().counters[Bigram::Metrics::RECORDS_INSERTED]);
+    CPPUNIT_ASSERT_EQUAL(size_t(4), dict_->search("ultrices").size());
+    CPPUNIT_ASSERT_EQUAL(size_t(12), dict_->search("ingest test").size());
+    CPPUNIT_ASSERT_EQUAL(2, int(dict_->lookup_digest(Bigram::digest_file(again.back())).size()));
+
+    // files that are not UTF-8 or not there are left out, the rest
+    // indexed; a copy of an undecodable file goes with it
+    {
+	std::ofstream os(scratch_path("binary.txt").c_str(), std::ios::binary);
+	os << "decoded part first\nab\xff" "cd\n";
+    }
+    {
+	std::ofstream os(scratch_path("binary-copy.txt").c_str(), std::ios::binary);
+	os << "decoded part first\nab\xff" "cd\n";
+    }
+    std::vector<Bigram::Path> mixed = {Bigram::Path(scratch_path("binary.txt")), paths[1],
+				       Bigram::Path(scratch_path("missing.txt")),
+				       Bigram::Path(scratch_path("binary-copy.txt"))};
+    std::shared_ptr<Bigram::MemoryDriver> mem(new Bigram::MemoryDriver);
+    Bigram::Dictionary dict(mem);
+    std::vector<std::pair<Bigram::Path, std::string>> skipped;
+    dict.add(mixed, 2, &skipped);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), skipped.size());
+    CPPUNIT_ASSERT_EQUAL(std::string(mixed[0]), std::string(skipped[0].first));
+    CPPUNIT_ASSERT_EQUAL(std::string(mixed[2]), std::string(skipped[1].first));
+    CPPUNIT_ASSERT_EQUAL(std::string(mixed[3]), std::string(skipped[2].first));
+    std::string digest;
+    Bigram::FileInfo info;
+    CPPUNIT_ASSERT(!mem->lookup_path(mixed[3], digest, info));
+    CPPUNIT_ASSERT(dict.search("decoded part").empty());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("file 0 of").size());
+
+    bool thrown = false;
+    try {
+	Bigram::Dictionary().add(mixed, 2);
+    } catch (const std::exception &) {
+	thrown = true;
+    } catch (const std::string &) {
+	thrown = true;
+    }
+    CPPUNIT_ASSERT(thrown);
+}
+
+void BigramTest::test_sync() {
+    remove(scratch_path("test5.sqlite").c_str());
+    std::shared_ptr<Bigram::Driver> drivers[] = {
+	std::shared_ptr<Bigram::Driver>(new Bigram::MemoryDriver),
+	std::shared_ptr<Bigram::Driver>(new Bigram::SQLiteDriver(scratch_path("test5.sqlite"))),
+    };
+    for (auto &drv : drivers) {
+	std::vector<std::string> names;
+	std::vector<Bigram::Path> paths;
+	for (int i = 0; i < 3; i ++) {
+	    std::ostringstream name;
+	    name << scratch_path("sync") << i << ".txt";
+	    std::ofstream os(name.str());
+	    os << "sync file " << i << std::endl;
+	    names.push_back(name.str());
+	    paths.push_back(Bigram::Path(name.str()));
+	}
+	Bigram::Dictionary dict(drv);
+	dict.sync(paths);
+	CPPUNIT_ASSERT_EQUAL(size_t(3), dict.search("sync file").size());
+
+	// a change in size is picked up
+	{
+	    std::ofstream os(names[0].c_str());
+	    os << "grown file 0" << std::endl;
+	}
+	// a change that keeps size and mtime is trusted to be no change
+	std::string digest;
+	Bigram::FileInfo known;
+	CPPUNIT_ASSERT(drv->lookup_path(paths[1], digest, known));
+	{
+	    std::ofstream os(names[1].c_str());
+	    os << "sync fill 1" << std::endl;
+	}
+	struct timespec times[2];
+	times[0].tv_sec = times[1].tv_sec = known.mtime / 1000000000;
+	times[0].tv_nsec = times[1].tv_nsec = known.mtime % 1000000000;
+	utimensat(AT_FDCWD, names[1].c_str(), times, 0);
+	// a removed file leaves the index
+	remove(names[2].c_str());
+
+	dict.sync(paths);
+	auto result = dict.search("sync file");
+	CPPUNIT_ASSERT_EQUAL(size_t(1), result.size());
+	CPPUNIT_ASSERT(dict.lookup_digest(result.front().docid()).count(paths[1]));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("grown file 0").size());
+	CPPUNIT_ASSERT(dict.search("sync file 0").empty());
+	CPPUNIT_ASSERT(dict.search("sync fill").empty());
+	CPPUNIT_ASSERT(!drv->lookup_path(paths[2], digest, known));
+	CPPUNIT_ASSERT(dict.search("sync file 2").empty());
+
+	// a file that turns out not to be UTF-8 is skipped, the rest synced
+	{
+	    std::ofstream os(names[0].c_str(), std::ios::binary);
+	    os << "decoded part first\nab\xff" "cd\n";
+	}
+	{
+	    std::ofstream os(names[2].c_str());
+	    os << "sync file 2 is back" << std::endl;
+	}
+	std::vector<std::pair<Bigram::Path, std::string>> skipped;
+	dict.sync(paths, &skipped);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), skipped.size());
+	CPPUNIT_ASSERT_EQUAL(std::string(paths[0]), std::string(skipped[0].first));
+	CPPUNIT_ASSERT(dict.search("decoded part").empty());
+	CPPUNIT_ASSERT(dict.search("grown file 0").empty());
+	CPPUNIT_ASSERT(!drv->lookup_path(paths[0], digest, known));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("is back").size());
+
+	// so is a path that cannot be read at all
+	{
+	    std::ofstream os(names[1].c_str());
+	    os << "sync file 1 after the directory" << std::endl;
+	}
+	std::vector<Bigram::Path> with_directory = {Bigram::Path("test"), paths[1]};
+	skipped.clear();
+	dict.sync(with_directory, &skipped);
+	CPPUNIT_ASSERT_EQUAL(size_t(1), skipped.size());
+	CPPUNIT_ASSERT_EQUAL(std::string("test"), std::string(skipped[0].first));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("after the directory").size());
+    }
+}
+
+void BigramTest::test_document_table() {
+    auto &table = Bigram::DocumentTable::instance();
+    uint32_t doc = table.intern("\xb1\xf3\xa9\x36\x95\x33\xe3\x53\x92\xb3"
+				"\x61\xba\x5e\xcf\xa3\x91\x98\x14\xd1\x14");
+    CPPUNIT_ASSERT_EQUAL(doc, table.intern("\xb1\xf3\xa9\x36\x95\x33\xe3\x53\x92\xb3"
+					   "\x61\xba\x5e\xcf\xa3\x91\x98\x14\xd1\x14"));
+    CPPUNIT_ASSERT(table.intern("another") != doc);
+
+    Bigram::Position pos(doc, 42);
+    CPPUNIT_ASSERT_EQUAL(Bigram::Position("\xb1\xf3\xa9\x36\x95\x33\xe3\x53\x92\xb3"
+					  "\x61\xba\x5e\xcf\xa3\x91\x98\x14\xd1\x14", 42), pos);
+    CPPUNIT_ASSERT_EQUAL(std::string("\xb1\xf3\xa9\x36\x95\x33\xe3\x53\x92\xb3"
+				     "\x61\xba\x5e\xcf\xa3\x91\x98\x14\xd1\x14"),
+			 pos.docid());
+}
+
+void BigramTest::test_posting_list() {
+    Bigram::PostingList list;
+    list.add(3, 10);
+    list.add(3, 300);
+    list.add(1, 70000);
+    list.add(3, 20);
+    list.add(3, 20);
+    list.add(2, 5);
+    list.add(3, 400);
+
+    CPPUNIT_ASSERT_EQUAL(size_t(6), list.size());
+    CPPUNIT_ASSERT_EQUAL(size_t(3), list.document_count());
+
+    uint32_t expected[][2] = {{1, 70000}, {2, 5}, {3, 10}, {3, 20}, {3, 300}, {3, 400}};
+    auto cur = list.cursor();
+    for (auto &e : expected) {
+	CPPUNIT_ASSERT(cur.valid());
+	CPPUNIT_ASSERT_EQUAL(e[0], cur.document());
+	CPPUNIT_ASSERT_EQUAL(e[1], cur.position());
+	cur.next();
+    }
+    CPPUNIT_ASSERT(!cur.valid());
+    CPPUNIT_ASSERT(!Bigram::PostingList().cursor().valid());
+}
+
+void BigramTest::test_arena() {
+    Bigram::Arena::Options options;
+    options.block_size = 4096;
+    Bigram::Arena arena(options);
+    char *a = (char*)arena.allocate(3, 1);
+    uint64_t *b = (uint64_t*)arena.allocate(sizeof(uint64_t), alignof(uint64_t));
+    CPPUNIT_ASSERT_EQUAL(uintptr_t(0), uintptr_t(b) % alignof(uint64_t));
+    CPPUNIT_ASSERT(a + 3 <= (char*)b);
+    // larger than a block gets a block of its own
+    arena.allocate(10000, 16);
+    CPPUNIT_ASSERT(arena.capacity() >= 4096 + 10000);
+    // a reset keeps the first block only
+    arena.reset();
+    CPPUNIT_ASSERT_EQUAL(size_t(4096), arena.capacity());
+    CPPUNIT_ASSERT_EQUAL(size_t(0), arena.used());
+    CPPUNIT_ASSERT((char*)arena.allocate(3, 1) == a);
+
+    // the results of a driver without an arena
+    std::shared_ptr<Bigram::Driver> plain(new Bigram::SQLiteDriver(":memory:"));
+    Bigram::Dictionary source(plain);
+    source.add(Bigram::Path("test/lipsum.txt"));
+
+    const char *phrases[] = {"ultrices", "blandit vel", "nothing like this"};
+    bool huge[] = {false, true};
+    for (auto huge_pages : huge) {
+	Bigram::Arena::Options options;
+	options.huge_pages = huge_pages;
+	std::shared_ptr<Bigram::MemoryDriver> mem(new Bigram::MemoryDriver(options));
+	Bigram::Dictionary dict(mem);
+	dict.add(Bigram::Path("test/lipsum.txt"));
+	for (auto phrase : phrases) {
+	    auto expected = source.search(phrase);
+	    auto result = dict.search(phrase);
+	    CPPUNIT_ASSERT_EQUAL(expected.size(), result.size());
+	    CPPUNIT_ASSERT(std::equal(expected.cbegin(), expected.cend(), result.cbegin()));
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(4), dict.search("ultrices").size());
+	CPPUNIT_ASSERT(mem->memory_usage() >= options.block_size);
+
+	// lists stay valid after the driver is cleared, and after it and
+	// its arena are gone
+	auto list = mem->postings('u', 'l');
+	mem->clear();
+	CPPUNIT_ASSERT(dict.search("ultrices").empty());
+	CPPUNIT_ASSERT(list->cursor().valid());
+	dict.add(Bigram::Path("test/lipsum.txt"));
+	CPPUNIT_ASSERT_EQUAL(size_t(4), dict.search("ultrices").size());
+	mem.reset();
+	dict = Bigram::Dictionary();
+	CPPUNIT_ASSERT(list->cursor().valid());
+    }
+}
+
+void BigramTest::test_corpus() {
+    Corpus::Options options;
+    options.duplicates = 0.5;
+    options.emoji = 0.2;
+    Corpus::Generator generator(options);
+    Corpus::Generator again(options);
+
+    // documents depend on their number only, not on the order they are made in
+    std::string last = generator.document(99);
+    std::set<std::string> distinct;
+    for (uint64_t n = 0; n < 100; n ++)
+	distinct.insert(generator.document(n));
+    CPPUNIT_ASSERT_EQUAL(last, again.document(99));
+    // about half are copies
+    CPPUNIT_ASSERT(distinct.size() > 30 && distinct.size() < 70);
+
+    options.seed = 2;
+    CPPUNIT_ASSERT(Corpus::Generator(options).document(99) != last);
+
+    // lines within bounds; valid UTF-8 in all three scripts
+    std::istringstream is(last);
+    std::string line;
+    size_t lines = 0;
+    bool cjk = false, emoji = false;
+    while (std::getline(is, line)) {
+	lines ++;
+	CPPUNIT_ASSERT(line.length() >= options.min_line);
+	for (auto &c : Bigram::disassemble(line)) {
+	    cjk = cjk || (c.first >= 0x3000 && c.first < 0xa000);
+	    emoji = emoji || c.first >= 0x1f300;
+	}
+    }
+    CPPUNIT_ASSERT(lines >= options.min_lines && lines <= options.max_lines);
+    CPPUNIT_ASSERT(cjk && emoji);
+    for (auto &document : distinct) {
+	std::istringstream ds(document);
+	while (std::getline(ds, line))
+	    CPPUNIT_ASSERT(line.length() >= options.min_line);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(std::string("001/234/001234567.txt"), Corpus::Generator::path(1234567));
+
+    // a generated document is found by its own lines
+    Bigram::Dictionary dict;
+    std::istringstream doc(last);
+    dict.add("corpus-99", doc);
+    std::getline(std::istringstream(last), line);
+    CPPUNIT_ASSERT(!dict.search(line).empty());
+}
+
+void BigramTest::test_metrics() {
+    Bigram::Metrics &metrics = Bigram::Metrics::instance();
+    metrics.reset();
+
+    // "abcd" makes three records; the search looks up "bc" and "cd"
+    dict_->add("metrics", std::string("abcd"), 0);
+    auto result = dict_->search("bcd");
+    CPPUNIT_ASSERT_EQUAL(size_t(1), result.size());
+    Bigram::disassemble("xyz");
+
+    auto snapshot = metrics.snapshot();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(3), snapshot.counters[Bigram::Metrics::RECORDS_INSERTED]);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), snapshot.counters[Bigram::Metrics::LOOKUPS]);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), snapshot.counters[Bigram::Metrics::POSTINGS_SCANNED]);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), snapshot.counters[Bigram::Metrics::POSTINGS_RETURNED]);
+    // the added line, the query and the disassembled text
+    CPPUNIT_ASSERT_EQUAL(uint64_t(4 + 3 + 3), snapshot.counters[Bigram::Metrics::BYTES_DISASSEMBLED]);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), snapshot.count(Bigram::Metrics::SEARCH_LATENCY));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), snapshot.count(Bigram::Metrics::SQLITE_BATCH_LATENCY));
+
+    // a batch of queries is timed as a batch, not as one query
+    dict_->search_many({"abc", "bcd", "xyz"});
+    snapshot = metrics.snapshot();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), snapshot.count(Bigram::Metrics::SEARCH_LATENCY));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), snapshot.count(Bigram::Metrics::SEARCH_BATCH_LATENCY));
+
+    // counts from many threads all arrive
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 100; i ++) {
+	threads.push_back(std::thread([&metrics]() {
+		    for (int n = 0; n < 1000; n ++)
+			metrics.add(Bigram::Metrics::LOOKUPS);
+		    metrics.observe(Bigram::Metrics::SEARCH_LATENCY, 5000);
+		}));
+    }
+    for (auto &thread : threads)
+	thread.join();
+    snapshot = metrics.snapshot();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(100002 + 5), snapshot.counters[Bigram::Metrics::LOOKUPS]);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(101), snapshot.count(Bigram::Metrics::SEARCH_LATENCY));
+    // 5 microseconds is under 2^3
+    CPPUNIT_ASSERT(snapshot.buckets[Bigram::Metrics::SEARCH_LATENCY][3] >= 100);
+
+    std::shared_ptr<Bigram::Driver> lite(new Bigram::SQLiteDriver(":memory:"));
+    Bigram::Dictionary sqlite(lite);
+    std::istringstream lines("abcd\nefgh\n");
+    sqlite.add("metrics", lines);
+    snapshot = metrics.snapshot();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), snapshot.count(Bigram::Metrics::SQLITE_BATCH_LATENCY));
+
+    std::string text = snapshot.prometheus();
+    CPPUNIT_ASSERT(text.find("# TYPE bigram_lookups_total counter\nbigram_lookups_total 100007\n")
+		   != std::string::npos);
+    CPPUNIT_ASSERT(text.find("bigram_records_inserted_total 9\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("bigram_search_duration_seconds_bucket{le=\"8e-06\"} ")
+		   != std::string::npos);
+    CPPUNIT_ASSERT(text.find("bigram_search_duration_seconds_bucket{le=\"+Inf\"} 101\n")
+		   != std::string::npos);
+    CPPUNIT_ASSERT(text.find("bigram_search_duration_seconds_count 101\n") != std::string::npos);
+
+    // an add outside a batch is timed as a transaction, and lookups as reads
+    lite->add(Bigram::Record('a', 'b', Bigram::Position("unbatched", 0)));
+    snapshot = metrics.snapshot();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), snapshot.count(Bigram::Metrics::SQLITE_BATCH_LATENCY));
+    uint64_t reads = snapshot.count(Bigram::Metrics::SQLITE_READ_LATENCY);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), sqlite.search("ab").size());
+    std::string digest;
+    Bigram::FileInfo info;
+    CPPUNIT_ASSERT(!lite->lookup_path(Bigram::Path("nowhere"), digest, info));
+    CPPUNIT_ASSERT(lite->lookup_digest("nothing").empty());
+    snapshot = metrics.snapshot();
+    CPPUNIT_ASSERT(snapshot.count(Bigram::Metrics::SQLITE_READ_LATENCY) >= reads + 3);
+
+    metrics.reset();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), metrics.snapshot().counters[Bigram::Metrics::LOOKUPS]);
+}
+
+void BigramTest::test_snapshot() {
+    Bigram::SnapshotDriver::Options options;
+    options.publish_threshold = 200;
+    std::shared_ptr<Bigram::SnapshotDriver> drv(new Bigram::SnapshotDriver(options));
+    Bigram::Dictionary dict(drv);
+
+    // adds show up once published
+    dict.add("snapshot-0", "needle in a haystack", 0);
+    CPPUNIT_ASSERT(dict.search("needle").empty());
+    drv->publish();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("needle").size());
+
+    // readers never see fewer matches than before while a writer adds
+    std::atomic<bool> done(false);
+    std::thread writer([&]() {
+	    for (int i = 1; i <= 200; i ++) {
+		std::ostringstream id;
+		id << "snapshot-" << i;
+		dict.add(id.str(), "another needle, another haystack", 0);
+	    }
+	    drv->publish();
+	    done = true;
+	});
+    size_t seen = 1;
+    bool finished;
+    do {
+	finished = done;
+	size_t found = dict.search("needle").size();
+	CPPUNIT_ASSERT(found >= seen);
+	seen = found;
+    } while (!finished);
+    writer.join();
+    CPPUNIT_ASSERT_EQUAL(size_t(201), dict.search("needle").size());
+
+    // a list handed out before a publish is not changed by it
+    auto list = drv->postings('n', 'e');
+    size_t size = list->size();
+    dict.add("snapshot-extra", "needle", 0);
+    drv->publish();
+    CPPUNIT_ASSERT_EQUAL(size, list->size());
+    CPPUNIT_ASSERT_EQUAL(size + 1, drv->postings('n', 'e')->size());
+
+    drv->remove_document("snapshot-extra");
+    CPPUNIT_ASSERT_EQUAL(size, drv->postings('n', 'e')->size());
+    CPPUNIT_ASSERT_EQUAL(size_t(201), dict.search("needle").size());
+
+    // publishes append to the storage earlier lists are views of, and
+    // leave what those lists see alone
+    std::shared_ptr<Bigram::SnapshotDriver> growing(new Bigram::SnapshotDriver);
+    std::vector<std::shared_ptr<const Bigram::PostingList>> published_lists;
+    for (int i = 0; i < 100; i ++) {
+	std::ostringstream id;
+	id << "growing-" << i;
+	growing->add(Bigram::Record('g', 'r', Bigram::Position(id.str(), i)));
+	growing->publish();
+	published_lists.push_back(growing->postings('g', 'r'));
+    }
+    size_t shared = 0;
+    for (size_t i = 0; i < published_lists.size(); i ++) {
+	CPPUNIT_ASSERT_EQUAL(i + 1, published_lists[i]->size());
+	size_t n = 0;
+	for (auto cur = published_lists[i]->cursor(); cur.valid(); cur.next())
+	    n ++;
+	CPPUNIT_ASSERT_EQUAL(i + 1, n);
+	if (i > 0 && published_lists[i]->byte_data() == published_lists[i - 1]->byte_data())
+	    shared ++;
+    }
+    CPPUNIT_ASSERT(shared > 90);
+
+    // a document out of order goes into a new store
+    growing->add(Bigram::Record('g', 'r', Bigram::Position("growing-0", 1000)));
+    growing->publish();
+    auto cur = growing->postings('g', 'r')->cursor();
+    CPPUNIT_ASSERT(cur.seek(published_lists[0]->cursor().document(), 1000));
+    CPPUNIT_ASSERT_EQUAL(uint32_t(1000), cur.position());
+    CPPUNIT_ASSERT_EQUAL(size_t(101), growing->postings('g', 'r')->size());
+    CPPUNIT_ASSERT_EQUAL(size_t(100), published_lists.back()->size());
+
+    // files indexed in parallel are merged into the delta
+    std::shared_ptr<Bigram::SnapshotDriver> merged(new Bigram::SnapshotDriver);
+    Bigram::Dictionary parallel(merged);
+    std::vector<Bigram::Path> paths(3, Bigram::Path("test/lipsum.txt"));
+    parallel.add(paths, 2);
+    merged->publish();
+    CPPUNIT_ASSERT_EQUAL(size_t(4), parallel.search("ultrices").size());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), parallel.lookup_digest(
+			     parallel.search("ultrices").front().docid()).size());
+
+    // a path shows up for others with its postings, and goes with them
+    // when its batch is rolled back
+    std::shared_ptr<Bigram::SnapshotDriver> pending(new Bigram::SnapshotDriver);
+    auto published = [&pending](const std::string &path) {
+	bool found;
+	std::thread reader([&]() {
+		std::string digest;
+		Bigram::FileInfo info;
+		found = pending->lookup_path(Bigram::Path(path), digest, info);
+	    });
+	reader.join();
+	return found;
+    };
+    std::string digest;
+    Bigram::FileInfo info;
+    pending->begin_batch();
+    pending->add(Bigram::Record('p', 'q', Bigram::Position("kept", 0)));
+    pending->register_path(Bigram::Path("kept.txt"), "kept");
+    pending->begin_batch();
+    pending->add(Bigram::Record('p', 'q', Bigram::Position("dropped", 0)));
+    pending->register_path(Bigram::Path("dropped.txt"), "dropped");
+    CPPUNIT_ASSERT(pending->lookup_path(Bigram::Path("dropped.txt"), digest, info));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pending->lookup_digest("kept").size());
+    pending->rollback_batch();
+    CPPUNIT_ASSERT(!pending->lookup_path(Bigram::Path("dropped.txt"), digest, info));
+    pending->commit_batch();
+    CPPUNIT_ASSERT(!published("kept.txt"));
+    pending->publish();
+    CPPUNIT_ASSERT(published("kept.txt"));
+    CPPUNIT_ASSERT(!published("dropped.txt"));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pending->postings('p', 'q')->size());
+
+    pending->unregister_path(Bigram::Path("kept.txt"));
+    CPPUNIT_ASSERT(published("kept.txt"));
+    pending->publish();
+    CPPUNIT_ASSERT(!published("kept.txt"));
+
+    // the lists of one batch come from one snapshot
+    auto lists = pending->postings_batch({{'p', 'q'}, {'x', 'y'}});
+    CPPUNIT_ASSERT_EQUAL(size_t(1), lists[0]->size());
+    CPPUNIT_ASSERT_EQUAL(size_t(0), lists[1]->size());
+}
+
 void BigramTest::test_sqlite_lookup() {
-    remove("/Volumes/RAMDISK/test2.sqlite");
+    remove(scratch_path("test2.sqlite").c_str());
 
-    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver("/Volumes/RAMDISK/test2.sqlite"));
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver(scratch_path("test2.sqlite")));
     Bigram::Dictionary dict(drv);
 
     unsigned int position = 12345;
@@ -166,24 +1025,17 @@ void BigramTest::test_sqlite_lookup() {
 }
 
 void BigramTest::test_sqlite() {
-    remove("/Volumes/RAMDISK/test.sqlite");
+    remove(scratch_path("test.sqlite").c_str());
 
-    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver("/Volumes/RAMDISK/test.sqlite"));
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver(scratch_path("test.sqlite")));
     Bigram::Dictionary dict(drv);
 
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-
     try {
 	dict.add(Bigram::Path("test/lipsum.txt"));
     } catch(const std::string &str) {
 	CPPUNIT_FAIL(str.c_str());
     }
 
-    gettimeofday(&end, NULL);
-    auto ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
-    std::cout << " " << ms << " ms ";
-
     auto result = dict.search("ultrices");
     CPPUNIT_ASSERT_EQUAL(size_t(4), result.size());
     auto it = result.begin();
@@ -197,6 +1049,465 @@ void BigramTest::test_sqlite() {
     CPPUNIT_ASSERT(paths.find(Bigram::Path("test/lipsum.txt")) != paths.end());
 }
 
+void BigramTest::test_sqlite_batch() {
+    remove(scratch_path("test3.sqlite").c_str());
+
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver(scratch_path("test3.sqlite")));
+
+    std::vector<Bigram::Record> recs;
+    for (unsigned int i = 0; i < 1000; i ++)
+	recs.push_back(Bigram::Record('h', 'o', Bigram::Position(fileid_, i * 10)));
+    drv->add_batch(recs);
+
+    CPPUNIT_ASSERT_EQUAL(size_t(1000), drv->lookup('h', 'o').size());
+
+    // a failed batch leaves nothing behind
+    drv->begin_batch();
+    drv->add(Bigram::Record('x', 'y', Bigram::Position(fileid_, 1)));
+    drv->rollback_batch();
+    CPPUNIT_ASSERT(drv->lookup('x', 'y').empty());
+
+    // a failed inner batch is undone on its own, the outer one commits
+    drv->begin_batch();
+    drv->add(Bigram::Record('a', 'b', Bigram::Position(fileid_, 1)));
+    drv->begin_batch();
+    drv->add(Bigram::Record('a', 'b', Bigram::Position(fileid_, 2)));
+    drv->add(Bigram::Record('c', 'd', Bigram::Position(fileid_, 3)));
+    drv->rollback_batch();
+    drv->begin_batch();
+    drv->add(Bigram::Record('e', 'f', Bigram::Position(fileid_, 4)));
+    drv->commit_batch();
+    drv->commit_batch();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), drv->lookup('a', 'b').size());
+    CPPUNIT_ASSERT(drv->lookup('c', 'd').empty());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), drv->lookup('e', 'f').size());
+    std::vector<std::vector<uint32_t>> documents;
+    drv->documents_batch({{'a', 'b'}, {'c', 'd'}}, documents);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), documents[0].size());
+    CPPUNIT_ASSERT(documents[1].empty());
+}
+
+void BigramTest::test_sqlite_path_map() {
+    remove(scratch_path("test4.sqlite").c_str());
+
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver(scratch_path("test4.sqlite")));
+
+    // digests are binary and may contain NULs and quotes
+    std::string digest("\x00\"\x01' ", 5);
+    drv->register_path(Bigram::Path("test/\"quoted\" name.txt"), digest);
+
+    auto paths = drv->lookup_digest(digest);
+    CPPUNIT_ASSERT_EQUAL(1, int(paths.size()));
+    CPPUNIT_ASSERT(paths.find(Bigram::Path("test/\"quoted\" name.txt")) != paths.end());
+    CPPUNIT_ASSERT(drv->lookup_digest(std::string("\x00", 1)).empty());
+
+    drv->add(Bigram::Record('h', 'o', Bigram::Position(digest, 7)));
+    auto recs = drv->lookup('h', 'o');
+    CPPUNIT_ASSERT_EQUAL(1, int(recs.size()));
+    CPPUNIT_ASSERT_EQUAL(digest, recs.cbegin()->position().docid());
+}
+
+void BigramTest::test_sqlite_documents() {
+    remove(scratch_path("test7.sqlite").c_str());
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::SQLiteDriver(scratch_path("test7.sqlite")));
+    Bigram::Dictionary dict(drv);
+    Bigram::Dictionary source;
+    const char *texts[] = {"blandit vel", "blandit", "vel blandit", "xblandit velx"};
+    for (int i = 0; i < 4; i ++) {
+	std::ostringstream id;
+	id << "documents-" << i;
+	dict.add(id.str(), texts[i], 0);
+	source.add(id.str(), texts[i], 0);
+    }
+
+    std::vector<std::pair<int, int>> bigrams;
+    bigrams.push_back(std::make_pair('b', 'l'));
+    bigrams.push_back(std::make_pair(' ', 'v'));
+    std::vector<std::vector<uint32_t>> documents;
+    CPPUNIT_ASSERT(drv->documents_batch(bigrams, documents));
+    CPPUNIT_ASSERT_EQUAL(size_t(4), documents[0].size());
+    CPPUNIT_ASSERT_EQUAL(size_t(2), documents[1].size());
+    CPPUNIT_ASSERT(std::is_sorted(documents[0].cbegin(), documents[0].cend()));
+
+    // positions are only read for the documents asked for
+    auto lists = drv->postings_batch(bigrams, &documents[1]);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), lists[0]->size());
+
+    const char *phrases[] = {"blandit vel", "vel", "t v", "blandit velx", "nothing"};
+    for (auto phrase : phrases) {
+	auto expected = source.search(phrase);
+	auto result = dict.search(phrase);
+	CPPUNIT_ASSERT_EQUAL(expected.size(), result.size());
+	CPPUNIT_ASSERT(std::equal(expected.cbegin(), expected.cend(), result.cbegin()));
+    }
+
+    // the document sets follow removals
+    drv->remove_document("documents-3");
+    CPPUNIT_ASSERT(drv->documents_batch(bigrams, documents));
+    CPPUNIT_ASSERT_EQUAL(size_t(3), documents[0].size());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("blandit vel").size());
+
+    // a bigram in too many documents is not worth pruning with; merged
+    // from a segment, the postings arrive a document at a time
+    Bigram::MemoryDriver segment;
+    for (int i = 0; i < 5000; i ++)
+	segment.add(Bigram::Record('q', 'z', Bigram::Position("common-" + std::to_string(i), i)));
+    drv->merge(segment);
+    bigrams.push_back(std::make_pair('q', 'z'));
+    CPPUNIT_ASSERT(!drv->documents_batch(bigrams, documents));
+    CPPUNIT_ASSERT_EQUAL(size_t(5000), drv->postings('q', 'z')->size());
+    CPPUNIT_ASSERT_EQUAL(size_t(5000), dict.search("qz").size());
+}
+
+void BigramTest::test_caching_driver() {
+    remove(scratch_path("test6.sqlite").c_str());
+    std::shared_ptr<Bigram::Driver> sqlite(new Bigram::SQLiteDriver(scratch_path("test6.sqlite")));
+    std::shared_ptr<Bigram::CachingDriver> cache(new Bigram::CachingDriver(sqlite, 1 << 20));
+    Bigram::Dictionary dict(cache);
+    dict.add(fileid_, text_, 0);
+
+    auto expected = dict.search("blandit vel");
+    CPPUNIT_ASSERT_EQUAL(size_t(1), expected.size());
+    size_t misses = cache->misses();
+    CPPUNIT_ASSERT(misses > 0);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), cache->hits());
+
+    // the same bigrams again come from the cache
+    auto result = dict.search("blandit vel");
+    CPPUNIT_ASSERT(expected == result);
+    CPPUNIT_ASSERT_EQUAL(misses, cache->misses());
+    CPPUNIT_ASSERT_EQUAL(misses, cache->hits());
+
+    // an add makes the bigrams it touches miss again
+    dict.add("another", "blandit vel", 0);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), dict.search("blandit vel").size());
+    CPPUNIT_ASSERT(cache->misses() > misses);
+
+    // and so does a removal
+    cache->remove_document("another");
+    CPPUNIT_ASSERT_EQUAL(size_t(1), dict.search("blandit vel").size());
+
+    // the budget holds however many lists are fetched
+    std::shared_ptr<Bigram::CachingDriver> small(new Bigram::CachingDriver(sqlite, 600));
+    Bigram::Dictionary bounded(small);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), bounded.search("Nunc facilisis odio").size());
+    CPPUNIT_ASSERT(small->size() > 0);
+    CPPUNIT_ASSERT(small->size() <= 600);
+
+    // a list fetched while the driver was written to is not kept
+    std::shared_ptr<InterleavedDriver> mem(new InterleavedDriver);
+    std::shared_ptr<Bigram::CachingDriver> live(new Bigram::CachingDriver(mem, 1 << 20));
+    live->add(Bigram::Record('a', 'b', Bigram::Position("one", 0)));
+    mem->during_fetch = [&live]() {
+	live->add(Bigram::Record('a', 'b', Bigram::Position("two", 0)));
+    };
+    live->postings('a', 'b');
+    CPPUNIT_ASSERT_EQUAL(size_t(0), live->size());
+    misses = live->misses();
+    CPPUNIT_ASSERT_EQUAL(size_t(2), live->postings('a', 'b')->document_count());
+    CPPUNIT_ASSERT_EQUAL(misses + 1, live->misses());
+    CPPUNIT_ASSERT(live->size() > 0);
+
+    // a live list that grows once cached is still accounted for at the
+    // cost it was inserted with
+    for (int i = 0; i < 100; i ++)
+	mem->add(Bigram::Record('a', 'b', Bigram::Position("three", i)));
+    live->add(Bigram::Record('a', 'b', Bigram::Position("four", 0)));
+    CPPUNIT_ASSERT_EQUAL(size_t(0), live->size());
+
+    // a list read inside a batch is dropped at the commit that shows the
+    // batch's adds
+    Bigram::SnapshotDriver::Options options;
+    options.publish_threshold = 1;
+    std::shared_ptr<Bigram::CachingDriver> snapshot(new Bigram::CachingDriver(
+	std::shared_ptr<Bigram::Driver>(new Bigram::SnapshotDriver(options)), 1 << 20));
+    snapshot->begin_batch();
+    snapshot->add(Bigram::Record('a', 'b', Bigram::Position("one", 0)));
+    CPPUNIT_ASSERT_EQUAL(size_t(0), snapshot->postings('a', 'b')->size());
+    snapshot->commit_batch();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), snapshot->postings('a', 'b')->size());
+}
+
+void BigramTest::test_mmap() {
+    std::shared_ptr<Bigram::MemoryDriver> mem(new Bigram::MemoryDriver);
+    Bigram::Dictionary source(mem);
+    source.add(Bigram::Path("test/lipsum.txt"));
+    source.add(fileid_, text_, 0);
+    source.add("漢字", "漢字カタカナ", 0);
+
+    Bigram::MmapDriver::write(scratch_path("test.idx"), *mem);
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::MmapDriver(scratch_path("test.idx")));
+    Bigram::Dictionary dict(drv);
+
+    const char *phrases[] = {"ultrices", "blandit vel", "カタカナ", "nothing like this"};
+    for (auto phrase : phrases) {
+	auto expected = source.search(phrase);
+	auto result = dict.search(phrase);
+	CPPUNIT_ASSERT_EQUAL(expected.size(), result.size());
+	CPPUNIT_ASSERT(std::equal(expected.cbegin(), expected.cend(), result.cbegin()));
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(4), dict.search("ultrices").size());
+    CPPUNIT_ASSERT(mem->lookup('l', 'v') == dict.lookup('l', 'v'));
+
+    auto paths = dict.lookup_digest(Bigram::digest_file("test/lipsum.txt"));
+    CPPUNIT_ASSERT_EQUAL(1, int(paths.size()));
+    CPPUNIT_ASSERT(paths.find(Bigram::Path("test/lipsum.txt")) != paths.end());
+    CPPUNIT_ASSERT(dict.lookup_digest("unknown digest").empty());
+
+    // lists stay valid after the driver that mapped them is gone
+    auto list = drv->postings('u', 'l');
+    drv.reset();
+    dict = Bigram::Dictionary();
+    CPPUNIT_ASSERT(list->cursor().valid());
+
+    bool thrown = false;
+    try {
+	Bigram::MmapDriver(scratch_path("test.idx")).add(
+	    Bigram::Record('h', 'o', Bigram::Position(fileid_, 0)));
+    } catch (const std::string &) {
+	thrown = true;
+    }
+    CPPUNIT_ASSERT(thrown);
+
+    // a directory pointing past the end of the file fails to open; the
+    // first bigram's directory offset follows the 64-byte header and its key
+    {
+	std::fstream fs(scratch_path("test.idx").c_str(),
+			std::ios::in | std::ios::out | std::ios::binary);
+	uint64_t offset = uint64_t(1) << 40;
+	fs.seekp(64 + 8);
+	fs.write((const char*)&offset, sizeof(offset));
+    }
+    thrown = false;
+    try {
+	Bigram::MmapDriver corrupt(scratch_path("test.idx"));
+    } catch (const std::string &) {
+	thrown = true;
+    }
+    CPPUNIT_ASSERT(thrown);
+}
+
 // Local Variables:
 // coding: utf-8
 // End:
+
+namespace {
+    // Just enough of a Redis server for RedisDriver: one client at a time,
+    // and only the commands the driver sends.
+    class FakeRedis {
+    public:
+	FakeRedis() {
+	    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+	    struct sockaddr_in addr;
+	    memset(&addr, 0, sizeof(addr));
+	    addr.sin_family = AF_INET;
+	    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	    bind(listener_, (struct sockaddr*)&addr, sizeof(addr));
+	    listen(listener_, 1);
+	    socklen_t length = sizeof(addr);
+	    getsockname(listener_, (struct sockaddr*)&addr, &length);
+	    port_ = ntohs(addr.sin_port);
+	    commands_ = 0;
+	    reads_ = 0;
+	    thread_ = std::thread([this]() { serve(); });
+	}
+	~FakeRedis() {
+	    shutdown(listener_, SHUT_RDWR);
+	    thread_.join();
+	    close(listener_);
+	}
+	unsigned short port() const { return port_; }
+	size_t commands() const { return commands_; }
+	size_t reads() const { return reads_; }
+
+    private:
+	void serve() {
+	    int fd;
+	    while ((fd = accept(listener_, nullptr, nullptr)) >= 0) {
+		std::string in;
+		std::string out;
+		char buffer[65536];
+		ssize_t n;
+		while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+		    in.append(buffer, n);
+		    std::vector<std::string> args;
+		    size_t used;
+		    while ((used = parse(in, args)) > 0) {
+			out += execute(args);
+			in.erase(0, used);
+		    }
+		    // everything pipelined so far is answered in one write,
+		    // once the client has stopped sending
+		    struct pollfd pfd = {fd, POLLIN, 0};
+		    if (!out.empty() && poll(&pfd, 1, 1) == 0) {
+			reads_ ++;
+			write(fd, out.data(), out.length());
+			out.clear();
+		    }
+		}
+		close(fd);
+	    }
+	}
+	// Returns the length of the first complete command, or 0.
+	static size_t parse(const std::string &in, std::vector<std::string> &args) {
+	    args.clear();
+	    size_t pos = 0;
+	    auto number = [&](char prefix, long &value) {
+		size_t end = in.find("\r\n", pos);
+		if (end == in.npos || in[pos] != prefix)
+		    return false;
+		value = strtol(in.c_str() + pos + 1, nullptr, 10);
+		pos = end + 2;
+		return true;
+	    };
+	    long count;
+	    if (pos >= in.length() || !number('*', count))
+		return 0;
+	    for (long i = 0; i < count; i ++) {
+		long length;
+		if (pos >= in.length() || !number('$', length))
+		    return 0;
+		if (in.length() < pos + length + 2)
+		    return 0;
+		args.push_back(in.substr(pos, length));
+		pos += length + 2;
+	    }
+	    return pos;
+	}
+	static std::string bulk(const std::string &s) {
+	    std::ostringstream oss;
+	    oss << "$" << s.length() << "\r\n" << s << "\r\n";
+	    return oss.str();
+	}
+	static std::string array(const std::vector<std::string> &elements) {
+	    std::ostringstream oss;
+	    oss << "*" << elements.size() << "\r\n";
+	    for (auto &e : elements)
+		oss << bulk(e);
+	    return oss.str();
+	}
+	std::string execute(const std::vector<std::string> &args) {
+	    commands_ ++;
+	    const std::string &cmd = args[0];
+	    if (cmd == "ZADD") {
+		zsets_[args[1]][args[3]] = atof(args[2].c_str());
+		return ":1\r\n";
+	    } else if (cmd == "ZRANGE") {
+		std::vector<std::pair<double, std::string>> members;
+		for (auto &m : zsets_[args[1]])
+		    members.push_back(std::make_pair(m.second, m.first));
+		std::sort(members.begin(), members.end());
+		std::vector<std::string> dest;
+		for (auto &m : members)
+		    dest.push_back(m.second);
+		return array(dest);
+	    } else if (cmd == "SADD") {
+		sets_[args[1]].insert(args[2]);
+		return ":1\r\n";
+	    } else if (cmd == "SREM") {
+		sets_[args[1]].erase(args[2]);
+		return ":1\r\n";
+	    } else if (cmd == "SMEMBERS") {
+		auto &set = sets_[args[1]];
+		return array(std::vector<std::string>(set.begin(), set.end()));
+	    } else if (cmd == "DEL") {
+		zsets_.erase(args[1]);
+		sets_.erase(args[1]);
+		hashes_.erase(args[1]);
+		return ":1\r\n";
+	    } else if (cmd == "HMSET") {
+		for (size_t i = 2; i + 1 < args.size(); i += 2)
+		    hashes_[args[1]][args[i]] = args[i + 1];
+		return "+OK\r\n";
+	    } else if (cmd == "HGET") {
+		auto it = hashes_.find(args[1]);
+		if (it == hashes_.end() || !it->second.count(args[2]))
+		    return "$-1\r\n";
+		return bulk(it->second[args[2]]);
+	    } else if (cmd == "HGETALL") {
+		std::vector<std::string> dest;
+		for (auto &field : hashes_[args[1]]) {
+		    dest.push_back(field.first);
+		    dest.push_back(field.second);
+		}
+		return array(dest);
+	    }
+	    return "-ERR unknown command '" + cmd + "'\r\n";
+	}
+
+	int listener_;
+	unsigned short port_;
+	std::thread thread_;
+	std::atomic<size_t> commands_;
+	std::atomic<size_t> reads_;
+	std::map<std::string, std::map<std::string, double>> zsets_;
+	std::map<std::string, std::set<std::string>> sets_;
+	std::map<std::string, std::map<std::string, std::string>> hashes_;
+    };
+}
+
+void BigramTest::test_redis() {
+    FakeRedis server;
+    std::shared_ptr<Bigram::Driver> drv(new Bigram::RedisDriver("127.0.0.1", server.port()));
+    Bigram::Dictionary dict(drv);
+    dict.add(Bigram::Path("test/lipsum.txt"));
+    dict.add(fileid_, text_, 0);
+    dict.add("漢字", "漢字カタカナ", 0);
+
+    Bigram::Dictionary source;
+    source.add(Bigram::Path("test/lipsum.txt"));
+    source.add(fileid_, text_, 0);
+    source.add("漢字", "漢字カタカナ", 0);
+
+    const char *phrases[] = {"ultrices", "blandit vel", "カタカナ", "nothing like this"};
+    for (auto phrase : phrases) {
+	auto expected = source.search(phrase);
+	auto result = dict.search(phrase);
+	CPPUNIT_ASSERT_EQUAL(expected.size(), result.size());
+	CPPUNIT_ASSERT(std::equal(expected.cbegin(), expected.cend(), result.cbegin()));
+    }
+    CPPUNIT_ASSERT(source.lookup('l', 'v') == dict.lookup('l', 'v'));
+
+    // a whole file goes out in a few pipelines, not a round trip per bigram
+    size_t reads = server.reads();
+    size_t commands = server.commands();
+    dict.add(Bigram::Path("test/lipsum.txt"));
+    std::ofstream(scratch_path("redis.txt")) << text_ << " and more" << std::endl;
+    dict.add(Bigram::Path(scratch_path("redis.txt")));
+    CPPUNIT_ASSERT(server.commands() - commands > 100);
+    CPPUNIT_ASSERT(server.reads() - reads < 10);
+
+    // and a query of many bigrams takes two
+    reads = server.reads();
+    dict.search("Cras pulvinar sollicitudin purus");
+    CPPUNIT_ASSERT_EQUAL(size_t(2), server.reads() - reads);
+
+    std::string digest;
+    Bigram::FileInfo info;
+    CPPUNIT_ASSERT(drv->lookup_path(Bigram::Path(scratch_path("redis.txt")), digest, info));
+    CPPUNIT_ASSERT(info.size > 0);
+    drv->unregister_path(Bigram::Path(scratch_path("redis.txt")));
+    drv->remove_document(digest);
+    CPPUNIT_ASSERT(dict.search("and more").empty());
+    CPPUNIT_ASSERT(!drv->lookup_path(Bigram::Path(scratch_path("redis.txt")), digest, info));
+
+    // a failed inner batch takes back its postings, even those a full
+    // pipeline already sent, and its paths; the enclosing batch commits
+    drv->begin_batch();
+    drv->add(Bigram::Record('q', 'z', Bigram::Position("redis-outer", 1)));
+    drv->register_path(Bigram::Path("outer.txt"), "redis-outer");
+    drv->begin_batch();
+    for (unsigned int i = 0; i < 10000; i ++)
+	drv->add(Bigram::Record('q', 'z', Bigram::Position("redis-inner", i)));
+    drv->register_path(Bigram::Path("inner.txt"), "redis-inner");
+    CPPUNIT_ASSERT(drv->lookup_path(Bigram::Path("inner.txt"), digest, info));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), drv->lookup_digest("redis-inner").size());
+    drv->rollback_batch();
+    CPPUNIT_ASSERT(drv->lookup_digest("redis-inner").empty());
+    drv->commit_batch();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), drv->lookup('q', 'z').size());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), drv->lookup_digest("redis-outer").size());
+    CPPUNIT_ASSERT(!drv->lookup_path(Bigram::Path("inner.txt"), digest, info));
+    CPPUNIT_ASSERT(drv->lookup_path(Bigram::Path("outer.txt"), digest, info));
+    CPPUNIT_ASSERT_EQUAL(std::string("redis-outer"), digest);
+}